@@ -0,0 +1,556 @@
+// btree.hh
+//
+// Ordered set kept in a B+ tree with fixed size nodes, used for the
+// sorted station indexes in Datastructures.
+
+#ifndef BTREE_HH
+#define BTREE_HH
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <memory_resource>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Ordered set of Keys in a B+ tree whose nodes are NodeBytes bytes. All
+// keys are in the leaves, and the leaves are linked in key order, so an
+// ordered walk reads consecutive keys out of a few wide nodes instead of
+// chasing one heap node per key like std::set does. Inner nodes only
+// hold separator keys and child pointers.
+//
+// Keys have to be default constructible and cheap to copy; they are
+// moved around inside the node arrays. Separators are always keys that
+// are in the set, so Compare may look up data that only stays valid
+// while its key is in the set (e.g. a handle into a table of names that
+// is reused after the key is erased). Inserting and erasing invalidate
+// iterators. Nodes come from the given memory resource, and erased nodes
+// are kept on a free list for the next insert.
+template <typename Key, typename Compare = std::less<Key>, std::size_t NodeBytes = 256>
+class BTreeSet
+{
+    // Two pointers' worth of each node go to the header and the next
+    // leaf pointer, the rest to keys (and child pointers)
+    static constexpr std::size_t LEAF_KEYS =
+        std::max<std::size_t>(3, (NodeBytes - 2 * sizeof(void*)) / sizeof(Key));
+    static constexpr std::size_t INNER_KEYS =
+        std::max<std::size_t>(3, (NodeBytes - 2 * sizeof(void*)) / (sizeof(Key) + sizeof(void*)));
+
+    struct Node
+    {
+        unsigned short count = 0;  // keys in the node
+        bool leaf = true;
+    };
+
+    struct Leaf : Node
+    {
+        Leaf* next = nullptr;
+        Key keys[LEAF_KEYS];
+    };
+
+    // children[i] holds the keys k with keys[i-1] <= k < keys[i]
+    struct Inner : Node
+    {
+        Key keys[INNER_KEYS];
+        Node* children[INNER_KEYS + 1];
+    };
+
+    static constexpr std::size_t NODE_SIZE = std::max(sizeof(Leaf), sizeof(Inner));
+    static constexpr std::size_t NODE_ALIGN = std::max(alignof(Leaf), alignof(Inner));
+
+public:
+    class const_iterator
+    {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = Key;
+        using difference_type = std::ptrdiff_t;
+        using pointer = Key const*;
+        using reference = Key const&;
+
+        const_iterator(Leaf const* leaf = nullptr, std::size_t index = 0) : leaf_(leaf), index_(index) {}
+
+        Key const& operator*() const { return (*leaf_).keys[index_]; }
+        Key const* operator->() const { return &(*leaf_).keys[index_]; }
+        const_iterator& operator++()
+        {
+            if (++index_ == (*leaf_).count) {
+                leaf_ = (*leaf_).next;
+                index_ = 0;
+            }
+            return *this;
+        }
+        const_iterator operator++(int) { auto old = *this; ++*this; return old; }
+        bool operator==(const_iterator const& other) const { return leaf_ == other.leaf_ && index_ == other.index_; }
+        bool operator!=(const_iterator const& other) const { return !(*this == other); }
+
+    private:
+        Leaf const* leaf_;
+        std::size_t index_;
+    };
+
+    explicit BTreeSet(Compare less = Compare(),
+                      std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : less_(less), resource_(resource) {}
+    BTreeSet(BTreeSet const&) = delete;
+    BTreeSet& operator=(BTreeSet const&) = delete;
+    ~BTreeSet() { clear(); }
+
+    std::size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    const_iterator begin() const
+    {
+        if (size_ == 0) {
+            return end();
+        }
+        Node const* node = root_;
+        while (!(*node).leaf) {
+            node = static_cast<Inner const*>(node)->children[0];
+        }
+        return {static_cast<Leaf const*>(node), 0};
+    }
+    const_iterator end() const { return {}; }
+
+    // First key that is not less than key
+    const_iterator lower_bound(Key const& key) const
+    {
+        if (size_ == 0) {
+            return end();
+        }
+        Leaf const* leaf = find_leaf(key);
+        auto index = std::lower_bound((*leaf).keys, (*leaf).keys + (*leaf).count, key, less_) - (*leaf).keys;
+        if (static_cast<std::size_t>(index) == (*leaf).count) {
+            return {(*leaf).next, 0};
+        }
+        return {leaf, static_cast<std::size_t>(index)};
+    }
+
+    bool contains(Key const& key) const
+    {
+        auto found = lower_bound(key);
+        return found != end() && !less_(key, *found);
+    }
+
+    // Returns false if an equivalent key is already in the set
+    bool insert(Key const& key)
+    {
+        if (root_ == nullptr) {
+            root_ = new_leaf();
+        }
+        Key separator;
+        Node* split = nullptr;
+        if (!insert(root_, key, separator, split)) {
+            return false;
+        }
+        if (split != nullptr) {
+            Inner* root = new_inner();
+            (*root).count = 1;
+            (*root).keys[0] = separator;
+            (*root).children[0] = root_;
+            (*root).children[1] = split;
+            root_ = root;
+        }
+        ++size_;
+        return true;
+    }
+
+    // Returns false if no equivalent key is in the set
+    bool erase(Key const& key)
+    {
+        if (root_ == nullptr || !erase(root_, key)) {
+            return false;
+        }
+        --size_;
+        if (!(*root_).leaf && (*root_).count == 0) {
+            Node* old = root_;
+            root_ = static_cast<Inner*>(old)->children[0];
+            free_node(old);
+        }
+        replace_separator(key);
+        return true;
+    }
+
+    // Inserts the keys of a sorted range without duplicates. An empty set
+    // or a big batch is built bottom-up from the merged keys in linear
+    // time, a small batch is inserted key by key.
+    template <typename It>
+    void insert_sorted(It first, It last)
+    {
+        auto count = static_cast<std::size_t>(std::distance(first, last));
+        if (count == 0) {
+            return;
+        }
+        if (size_ != 0 && count < size_ / 8) {
+            for (; first != last; ++first) {
+                insert(*first);
+            }
+            return;
+        }
+        std::vector<Key> keys;
+        keys.reserve(size_ + count);
+        std::set_union(begin(), end(), first, last, std::back_inserter(keys), less_);
+        if (root_ != nullptr) {
+            recycle(root_);
+            root_ = nullptr;
+        }
+        build(keys);
+    }
+
+    void clear()
+    {
+        if (root_ != nullptr) {
+            destroy(root_);
+            root_ = nullptr;
+        }
+        while (free_ != nullptr) {
+            Node* next = *reinterpret_cast<Node**>(free_);
+            resource_->deallocate(free_, NODE_SIZE, NODE_ALIGN);
+            free_ = next;
+        }
+        size_ = 0;
+    }
+
+private:
+    Compare less_;
+    std::pmr::memory_resource* resource_;
+    Node* root_ = nullptr;
+    Node* free_ = nullptr;  // unused nodes, each holding a pointer to the next
+    std::size_t size_ = 0;
+
+    Leaf* new_leaf() { return new (take_node()) Leaf(); }
+    Inner* new_inner()
+    {
+        Inner* inner = new (take_node()) Inner();
+        (*inner).leaf = false;
+        return inner;
+    }
+    void* take_node()
+    {
+        if (free_ == nullptr) {
+            return resource_->allocate(NODE_SIZE, NODE_ALIGN);
+        }
+        Node* node = free_;
+        free_ = *reinterpret_cast<Node**>(node);
+        return node;
+    }
+    void free_node(Node* node)
+    {
+        if ((*node).leaf) {
+            static_cast<Leaf*>(node)->~Leaf();
+        } else {
+            static_cast<Inner*>(node)->~Inner();
+        }
+        *reinterpret_cast<Node**>(node) = free_;
+        free_ = node;
+    }
+    void destroy(Node* node)
+    {
+        if (!(*node).leaf) {
+            Inner* inner = static_cast<Inner*>(node);
+            for (std::size_t i = 0; i <= (*inner).count; ++i) {
+                destroy((*inner).children[i]);
+            }
+            inner->~Inner();
+        } else {
+            static_cast<Leaf*>(node)->~Leaf();
+        }
+        resource_->deallocate(node, NODE_SIZE, NODE_ALIGN);
+    }
+
+    // Puts node and everything below it on the free list
+    void recycle(Node* node)
+    {
+        if (!(*node).leaf) {
+            Inner* inner = static_cast<Inner*>(node);
+            for (std::size_t i = 0; i <= (*inner).count; ++i) {
+                recycle((*inner).children[i]);
+            }
+        }
+        free_node(node);
+    }
+
+    // Builds the tree of the sorted keys one level at a time. The nodes
+    // of a level share the entries evenly, which keeps each of them at
+    // least half full.
+    void build(std::vector<Key> const& keys)
+    {
+        size_ = keys.size();
+        if (keys.empty()) {
+            return;
+        }
+
+        // Nodes of the level being built, with the smallest key below each
+        std::vector<std::pair<Node*, Key>> level;
+        std::size_t leaves = (keys.size() + LEAF_KEYS - 1) / LEAF_KEYS;
+        Leaf* previous = nullptr;
+        for (std::size_t i = 0, first = 0; i < leaves; ++i) {
+            std::size_t last = keys.size() * (i + 1) / leaves;
+            Leaf* leaf = new_leaf();
+            std::copy(keys.begin() + first, keys.begin() + last, (*leaf).keys);
+            (*leaf).count = last - first;
+            if (previous != nullptr) {
+                (*previous).next = leaf;
+            }
+            previous = leaf;
+            level.emplace_back(leaf, keys[first]);
+            first = last;
+        }
+
+        while (level.size() > 1) {
+            std::vector<std::pair<Node*, Key>> parents;
+            std::size_t nodes = (level.size() + INNER_KEYS) / (INNER_KEYS + 1);
+            for (std::size_t i = 0, first = 0; i < nodes; ++i) {
+                std::size_t last = level.size() * (i + 1) / nodes;
+                Inner* inner = new_inner();
+                for (std::size_t j = first; j < last; ++j) {
+                    (*inner).children[j - first] = level[j].first;
+                    if (j != first) {
+                        (*inner).keys[j - first - 1] = level[j].second;
+                    }
+                }
+                (*inner).count = last - first - 1;
+                parents.emplace_back(inner, level[first].second);
+                first = last;
+            }
+            level.swap(parents);
+        }
+        root_ = level[0].first;
+    }
+
+    std::size_t child_index(Inner const* inner, Key const& key) const
+    {
+        return std::upper_bound((*inner).keys, (*inner).keys + (*inner).count, key, less_) - (*inner).keys;
+    }
+
+    Leaf const* find_leaf(Key const& key) const
+    {
+        Node const* node = root_;
+        while (!(*node).leaf) {
+            Inner const* inner = static_cast<Inner const*>(node);
+            node = (*inner).children[child_index(inner, key)];
+        }
+        return static_cast<Leaf const*>(node);
+    }
+
+    // Inserts key below node. If node had to be split, split is the new
+    // right half and separator its smallest key.
+    bool insert(Node* node, Key const& key, Key& separator, Node*& split)
+    {
+        if ((*node).leaf) {
+            Leaf* leaf = static_cast<Leaf*>(node);
+            Key* position = std::lower_bound((*leaf).keys, (*leaf).keys + (*leaf).count, key, less_);
+            if (position != (*leaf).keys + (*leaf).count && !less_(key, *position)) {
+                return false;
+            }
+            auto index = position - (*leaf).keys;
+            if ((*leaf).count < LEAF_KEYS) {
+                std::copy_backward(position, (*leaf).keys + (*leaf).count, (*leaf).keys + (*leaf).count + 1);
+                *position = key;
+                ++(*leaf).count;
+                return true;
+            }
+
+            // Full: the upper half goes to a new leaf
+            Leaf* right = new_leaf();
+            std::size_t left_count = (LEAF_KEYS + 1) / 2;
+            Key all[LEAF_KEYS + 1];
+            std::copy((*leaf).keys, position, all);
+            all[index] = key;
+            std::copy(position, (*leaf).keys + LEAF_KEYS, all + index + 1);
+            std::copy(all, all + left_count, (*leaf).keys);
+            std::copy(all + left_count, all + LEAF_KEYS + 1, (*right).keys);
+            (*leaf).count = left_count;
+            (*right).count = LEAF_KEYS + 1 - left_count;
+            (*right).next = (*leaf).next;
+            (*leaf).next = right;
+            separator = (*right).keys[0];
+            split = right;
+            return true;
+        }
+
+        Inner* inner = static_cast<Inner*>(node);
+        auto index = child_index(inner, key);
+        Key child_separator;
+        Node* child_split = nullptr;
+        if (!insert((*inner).children[index], key, child_separator, child_split)) {
+            return false;
+        }
+        if (child_split == nullptr) {
+            return true;
+        }
+
+        if ((*inner).count < INNER_KEYS) {
+            std::copy_backward((*inner).keys + index, (*inner).keys + (*inner).count, (*inner).keys + (*inner).count + 1);
+            std::copy_backward((*inner).children + index + 1, (*inner).children + (*inner).count + 1,
+                               (*inner).children + (*inner).count + 2);
+            (*inner).keys[index] = child_separator;
+            (*inner).children[index + 1] = child_split;
+            ++(*inner).count;
+            return true;
+        }
+
+        // Full: the middle key moves up, the keys after it to a new node
+        Key keys[INNER_KEYS + 1];
+        Node* children[INNER_KEYS + 2];
+        std::copy((*inner).keys, (*inner).keys + index, keys);
+        keys[index] = child_separator;
+        std::copy((*inner).keys + index, (*inner).keys + INNER_KEYS, keys + index + 1);
+        std::copy((*inner).children, (*inner).children + index + 1, children);
+        children[index + 1] = child_split;
+        std::copy((*inner).children + index + 1, (*inner).children + INNER_KEYS + 1, children + index + 2);
+
+        Inner* right = new_inner();
+        std::size_t left_count = (INNER_KEYS + 1) / 2;
+        std::copy(keys, keys + left_count, (*inner).keys);
+        std::copy(children, children + left_count + 1, (*inner).children);
+        (*inner).count = left_count;
+        std::copy(keys + left_count + 1, keys + INNER_KEYS + 1, (*right).keys);
+        std::copy(children + left_count + 1, children + INNER_KEYS + 2, (*right).children);
+        (*right).count = INNER_KEYS - left_count;
+        separator = keys[left_count];
+        split = right;
+        return true;
+    }
+
+    // An erased key can still be a separator in one inner node; it is
+    // replaced there by the smallest key to its right
+    void replace_separator(Key const& key)
+    {
+        Node* node = root_;
+        while (!(*node).leaf) {
+            Inner* inner = static_cast<Inner*>(node);
+            Key* position = std::lower_bound((*inner).keys, (*inner).keys + (*inner).count, key, less_);
+            auto index = position - (*inner).keys;
+            if (position != (*inner).keys + (*inner).count && !less_(key, *position)) {
+                Node* right = (*inner).children[index + 1];
+                while (!(*right).leaf) {
+                    right = static_cast<Inner*>(right)->children[0];
+                }
+                *position = static_cast<Leaf*>(right)->keys[0];
+                return;
+            }
+            node = (*inner).children[index];
+        }
+    }
+
+    bool erase(Node* node, Key const& key)
+    {
+        if ((*node).leaf) {
+            Leaf* leaf = static_cast<Leaf*>(node);
+            Key* position = std::lower_bound((*leaf).keys, (*leaf).keys + (*leaf).count, key, less_);
+            if (position == (*leaf).keys + (*leaf).count || less_(key, *position)) {
+                return false;
+            }
+            std::copy(position + 1, (*leaf).keys + (*leaf).count, position);
+            --(*leaf).count;
+            return true;
+        }
+
+        Inner* inner = static_cast<Inner*>(node);
+        auto index = child_index(inner, key);
+        if (!erase((*inner).children[index], key)) {
+            return false;
+        }
+        Node* child = (*inner).children[index];
+        std::size_t min_count = (*child).leaf ? LEAF_KEYS / 2 : INNER_KEYS / 2;
+        if ((*child).count < min_count) {
+            rebalance(inner, index, min_count);
+        }
+        return true;
+    }
+
+    // Refills the underfull child at index from a sibling, or merges it
+    // with one
+    void rebalance(Inner* parent, std::size_t index, std::size_t min_count)
+    {
+        Node* left = index > 0 ? (*parent).children[index - 1] : nullptr;
+        Node* right = index < (*parent).count ? (*parent).children[index + 1] : nullptr;
+
+        if (left != nullptr && (*left).count > min_count) {
+            borrow_from_left(parent, index);
+        } else if (right != nullptr && (*right).count > min_count) {
+            borrow_from_right(parent, index);
+        } else if (left != nullptr) {
+            merge(parent, index - 1);
+        } else if (right != nullptr) {
+            merge(parent, index);
+        }
+    }
+
+    void borrow_from_left(Inner* parent, std::size_t index)
+    {
+        Node* child = (*parent).children[index];
+        Node* left = (*parent).children[index - 1];
+        if ((*child).leaf) {
+            Leaf* to = static_cast<Leaf*>(child);
+            Leaf* from = static_cast<Leaf*>(left);
+            std::copy_backward((*to).keys, (*to).keys + (*to).count, (*to).keys + (*to).count + 1);
+            (*to).keys[0] = (*from).keys[(*from).count - 1];
+            (*parent).keys[index - 1] = (*to).keys[0];
+        } else {
+            Inner* to = static_cast<Inner*>(child);
+            Inner* from = static_cast<Inner*>(left);
+            std::copy_backward((*to).keys, (*to).keys + (*to).count, (*to).keys + (*to).count + 1);
+            std::copy_backward((*to).children, (*to).children + (*to).count + 1, (*to).children + (*to).count + 2);
+            (*to).keys[0] = (*parent).keys[index - 1];
+            (*to).children[0] = (*from).children[(*from).count];
+            (*parent).keys[index - 1] = (*from).keys[(*from).count - 1];
+        }
+        ++(*child).count;
+        --(*left).count;
+    }
+
+    void borrow_from_right(Inner* parent, std::size_t index)
+    {
+        Node* child = (*parent).children[index];
+        Node* right = (*parent).children[index + 1];
+        if ((*child).leaf) {
+            Leaf* to = static_cast<Leaf*>(child);
+            Leaf* from = static_cast<Leaf*>(right);
+            (*to).keys[(*to).count] = (*from).keys[0];
+            std::copy((*from).keys + 1, (*from).keys + (*from).count, (*from).keys);
+            (*parent).keys[index] = (*from).keys[0];
+        } else {
+            Inner* to = static_cast<Inner*>(child);
+            Inner* from = static_cast<Inner*>(right);
+            (*to).keys[(*to).count] = (*parent).keys[index];
+            (*to).children[(*to).count + 1] = (*from).children[0];
+            (*parent).keys[index] = (*from).keys[0];
+            std::copy((*from).keys + 1, (*from).keys + (*from).count, (*from).keys);
+            std::copy((*from).children + 1, (*from).children + (*from).count + 1, (*from).children);
+        }
+        ++(*child).count;
+        --(*right).count;
+    }
+
+    // Moves children[index + 1] into children[index] and drops it
+    void merge(Inner* parent, std::size_t index)
+    {
+        Node* left = (*parent).children[index];
+        Node* right = (*parent).children[index + 1];
+        if ((*left).leaf) {
+            Leaf* to = static_cast<Leaf*>(left);
+            Leaf* from = static_cast<Leaf*>(right);
+            std::copy((*from).keys, (*from).keys + (*from).count, (*to).keys + (*to).count);
+            (*to).count += (*from).count;
+            (*to).next = (*from).next;
+        } else {
+            Inner* to = static_cast<Inner*>(left);
+            Inner* from = static_cast<Inner*>(right);
+            (*to).keys[(*to).count] = (*parent).keys[index];
+            std::copy((*from).keys, (*from).keys + (*from).count, (*to).keys + (*to).count + 1);
+            std::copy((*from).children, (*from).children + (*from).count + 1, (*to).children + (*to).count + 1);
+            (*to).count += (*from).count + 1;
+        }
+        std::copy((*parent).keys + index + 1, (*parent).keys + (*parent).count, (*parent).keys + index);
+        std::copy((*parent).children + index + 2, (*parent).children + (*parent).count + 1,
+                  (*parent).children + index + 1);
+        --(*parent).count;
+        free_node(right);
+    }
+};
+
+#endif // BTREE_HH
@@ -9,26 +9,1278 @@
 #include <random>
 
 #include <cmath>
+#include <cstdlib>
+#include <system_error>
+#include <thread>
+
+#if defined(__AVX2__) || defined(__SSE4_1__)
+#include <immintrin.h>
+#endif
 
 std::minstd_rand rand_engine; // Reasonably quick pseudo-random generator
 
-template <typename Type>
-Type random_in_range(Type start, Type end)
+template <typename Type>
+Type random_in_range(Type start, Type end)
+{
+    auto range = end-start;
+    ++range;
+
+    auto num = std::uniform_int_distribution<unsigned long int>(0, range-1)(rand_engine);
+
+    return static_cast<Type>(start+num);
+}
+
+namespace
+{
+// Subtrees deeper than log_(1/ALPHA)(n) get rebuilt, see KdTree::insert
+double const KDTREE_ALPHA = 0.7;
+
+// New stations MortonIndex keeps unsorted before they become a run
+std::size_t const MORTON_BUFFER_SIZE = 64;
+
+// Smallest share of a stations_closest_to_batch call worth its own thread
+std::size_t const BATCH_POINTS_PER_THREAD = 256;
+
+// Most regions RegionTree::attach renumbers or resizes one by one, more
+// are left to RegionTree::update
+unsigned int const REGION_MOVE_MAX = 1024;
+
+// Ranges shorter than this are left to std::sort by sort_by_name
+std::ptrdiff_t const RADIX_SORT_CUTOFF = 32;
+
+// Smallest batch of new stations whose two index orders are sorted in
+// parallel
+std::size_t const PARALLEL_INDEX_SORT_MIN = 1 << 16;
+
+// Sorts handles like StationNameLess. Most significant character first:
+// the handles are bucketed by the character at some depth, and each
+// bucket is sorted on the next one. A name that ends at depth goes before
+// the longer ones. The buckets still to sort are kept on a stack instead
+// of recursing, since names sharing a long prefix would go one call deeper
+// per shared character. scratch and chars need room for last - first
+// entries.
+void sort_by_name(StationHandle* first, StationHandle* last, StationColumns const& columns,
+                  StationHandle* scratch, unsigned short* chars)
+{
+    struct Bucket
+    {
+        StationHandle* first;
+        StationHandle* last;
+        std::size_t depth;  // the names agree on this many characters
+    };
+    std::vector<Bucket> buckets{{first, last, 0}};
+    std::size_t starts[258];
+    std::size_t next[257];
+
+    while (!buckets.empty()) {
+        auto bucket = buckets.back();
+        buckets.pop_back();
+        if (bucket.last - bucket.first < RADIX_SORT_CUTOFF) {
+            std::sort(bucket.first, bucket.last, StationNameLess{&columns});
+            continue;
+        }
+
+        std::size_t n = bucket.last - bucket.first;
+        std::fill(starts, starts + 258, 0);
+        for (std::size_t i = 0; i < n; ++i) {
+            auto const& name = columns.names[bucket.first[i]];
+            chars[i] = bucket.depth < name.size() ? 1 + static_cast<unsigned char>(name[bucket.depth]) : 0;
+            ++starts[chars[i] + 1];
+        }
+        for (std::size_t c = 1; c < 258; ++c) {
+            starts[c] += starts[c - 1];
+        }
+        std::copy(starts, starts + 257, next);
+        for (std::size_t i = 0; i < n; ++i) {
+            scratch[next[chars[i]]++] = bucket.first[i];
+        }
+        std::copy(scratch, scratch + n, bucket.first);
+
+        // The names that ended are equal, only their handles are left
+        std::sort(bucket.first, bucket.first + starts[1]);
+        for (std::size_t c = 1; c < 257; ++c) {
+            if (starts[c + 1] - starts[c] > 1) {
+                buckets.push_back({bucket.first + starts[c], bucket.first + starts[c + 1], bucket.depth + 1});
+            }
+        }
+    }
+}
+
+// Joins the started threads when it goes out of scope, so that an
+// exception thrown while they run does not destroy a joinable thread
+class ThreadJoiner
+{
+public:
+    explicit ThreadJoiner(std::vector<std::thread>& threads) : threads_(threads) {}
+    ~ThreadJoiner() { join(); }
+
+    void join()
+    {
+        for (auto& thread : threads_) {
+            if (thread.joinable()) {
+                thread.join();
+            }
+        }
+    }
+
+private:
+    std::vector<std::thread>& threads_;
+};
+}
+
+SymbolTable::Handle SymbolTable::intern(std::string_view s)
+{
+    auto found = handles_.find(s);
+    if (found != handles_.end()) {
+        return (*found).second;
+    }
+    Handle h;
+    if (free_.empty()) {
+        h = names_.size();
+        names_.emplace_back(s);
+    } else {
+        h = free_.back();
+        free_.pop_back();
+        names_[h] = s;
+    }
+    handles_.insert({names_[h], h});
+    return h;
+}
+
+SymbolTable::Handle SymbolTable::find(std::string_view s) const
+{
+    auto found = handles_.find(s);
+    return found == handles_.end() ? NONE : (*found).second;
+}
+
+void SymbolTable::release(Handle h)
+{
+    handles_.erase(std::string_view(names_[h]));
+    names_[h].clear();
+    free_.push_back(h);
+}
+
+void SymbolTable::clear()
+{
+    handles_.clear();
+    names_.clear();
+    free_.clear();
+}
+
+void StationColumns::open(StationHandle slot)
+{
+    if (slot == size()) {
+        names.emplace_back(NO_NAME);
+        xys.push_back(NO_COORD);
+        xy_keys.push_back(coord_key(NO_COORD));
+        region_parents.push_back(NO_REGION);
+        schedules.emplace_back();
+        coord_slots.push_back(0);
+        in_use.push_back(0);
+    }
+    in_use[slot] = 1;
+}
+
+void StationColumns::close(StationHandle slot)
+{
+    names[slot] = NO_NAME;
+    xys[slot] = NO_COORD;
+    xy_keys[slot] = coord_key(NO_COORD);
+    region_parents[slot] = NO_REGION;
+    schedules[slot].clear();
+    coord_slots[slot] = 0;
+    in_use[slot] = 0;
+}
+
+void StationColumns::clear()
+{
+    *this = StationColumns(names.get_allocator().resource());
+}
+
+void NearestHeap::offer(unsigned long long dist, CoordKey key, StationHandle id)
+{
+    if (dist > max_dist_ || k_ == 0) {
+        return;
+    }
+
+    auto by_closer = [this](Candidate const& a, Candidate const& b){ return closer(a, b); };
+    Candidate candidate{dist, key, id};
+    if (heap_.size() < k_) {
+        heap_.push_back(candidate);
+        std::push_heap(heap_.begin(), heap_.end(), by_closer);
+    } else if (closer(candidate, heap_.front())) {
+        std::pop_heap(heap_.begin(), heap_.end(), by_closer);
+        heap_.back() = candidate;
+        std::push_heap(heap_.begin(), heap_.end(), by_closer);
+    }
+}
+
+std::vector<StationHandle> NearestHeap::take()
+{
+    std::sort_heap(heap_.begin(), heap_.end(), [this](Candidate const& a, Candidate const& b){ return closer(a, b); });
+    std::vector<StationHandle> result;
+    result.reserve(heap_.size());
+    for (auto& i : heap_) {
+        result.push_back(i.id);
+    }
+    heap_.clear();
+    return result;
+}
+
+bool NearestHeap::closer(const Candidate &a, const Candidate &b) const
+{
+    if (a.dist != b.dist) {
+        return a.dist < b.dist;
+    }
+    if (!(a.key == b.key)) {
+        return a.key < b.key;
+    }
+    if (a.id == b.id) {
+        return false;
+    }
+    return (*ids_).name(a.id) < (*ids_).name(b.id);
+}
+
+void KdTree::insert(Coord xy, StationHandle id)
+{
+    int added = nodes_.size();
+    nodes_.push_back({xy, coord_key(xy), id});
+    ++live_;
+    if (root_ == -1) {
+        root_ = added;
+        return;
+    }
+
+    std::vector<int> path;
+    int current = root_;
+    while (true) {
+        path.push_back(current);
+        Node& node = nodes_[current];
+        ++node.size;
+        int& next = split_key(xy, node.axis) < split_key(node.xy, node.axis) ? node.left : node.right;
+        if (next == -1) {
+            next = added;
+            nodes_[added].axis = node.axis ^ 1;
+            break;
+        }
+        current = next;
+    }
+
+    double max_depth = std::log(static_cast<double>(nodes_.size())) / std::log(1.0 / KDTREE_ALPHA);
+    if (path.size() <= max_depth) {
+        return;
+    }
+
+    // Find the lowest ancestor whose child subtree got too large and rebuild it
+    int child = added;
+    for (auto i = path.size(); i-- > 0; ) {
+        int parent = path[i];
+        if (nodes_[child].size > KDTREE_ALPHA * nodes_[parent].size) {
+            std::vector<int> idx;
+            idx.reserve(nodes_[parent].size);
+            collect(parent, idx);
+            int rebuilt = build(idx, 0, idx.size(), nodes_[parent].axis);
+            if (i == 0) {
+                root_ = rebuilt;
+            } else if (nodes_[path[i-1]].left == parent) {
+                nodes_[path[i-1]].left = rebuilt;
+            } else {
+                nodes_[path[i-1]].right = rebuilt;
+            }
+            return;
+        }
+        child = parent;
+    }
+}
+
+bool KdTree::erase(Coord xy, StationHandle id)
+{
+    int found = find(root_, xy, id);
+    if (found == -1) {
+        return false;
+    }
+
+    nodes_[found].removed = true;
+    --live_;
+    if (live_ * 2 < nodes_.size()) {
+        rebuild_all();
+    }
+    return true;
+}
+
+void KdTree::clear()
+{
+    nodes_.clear();
+    root_ = -1;
+    live_ = 0;
+}
+
+StationHandle KdTree::find(Coord xy) const
+{
+    int found = find(root_, xy, SymbolTable::NONE);
+    if (found == -1) {
+        return SymbolTable::NONE;
+    }
+    return nodes_[found].id;
+}
+
+void KdTree::nearest(Coord xy, NearestHeap &heap) const
+{
+    if (heap.k() > 0) {
+        nearest(root_, xy, heap);
+    }
+}
+
+int KdTree::build(std::vector<int> &idx, std::size_t begin, std::size_t end, unsigned char axis)
+{
+    if (begin >= end) {
+        return -1;
+    }
+
+    auto mid = begin + (end - begin) / 2;
+    std::nth_element(idx.begin() + begin, idx.begin() + mid, idx.begin() + end,
+                     [this, axis](int a, int b){ return split_key(nodes_[a].xy, axis) < split_key(nodes_[b].xy, axis); });
+
+    int node = idx[mid];
+    nodes_[node].axis = axis;
+    nodes_[node].size = end - begin;
+    nodes_[node].left = build(idx, begin, mid, axis ^ 1);
+    nodes_[node].right = build(idx, mid + 1, end, axis ^ 1);
+    return node;
+}
+
+void KdTree::collect(int node, std::vector<int> &idx) const
+{
+    if (node == -1) {
+        return;
+    }
+    idx.push_back(node);
+    collect(nodes_[node].left, idx);
+    collect(nodes_[node].right, idx);
+}
+
+int KdTree::find(int node, Coord xy, StationHandle id) const
+{
+    if (node == -1) {
+        return -1;
+    }
+
+    Node const& n = nodes_[node];
+    if (!n.removed && n.xy == xy && (id == SymbolTable::NONE || n.id == id)) {
+        return node;
+    }
+
+    // Median splits may leave equal keys on both sides
+    int key = split_key(xy, n.axis);
+    int split = split_key(n.xy, n.axis);
+    if (key < split) {
+        return find(n.left, xy, id);
+    }
+    if (key > split) {
+        return find(n.right, xy, id);
+    }
+    int found = find(n.left, xy, id);
+    return found != -1 ? found : find(n.right, xy, id);
+}
+
+void KdTree::rebuild_all()
+{
+    std::vector<Node> live;
+    live.reserve(live_);
+    for (auto& n : nodes_) {
+        if (!n.removed) {
+            live.push_back(std::move(n));
+        }
+    }
+    nodes_ = std::move(live);
+
+    std::vector<int> idx(nodes_.size());
+    for (std::size_t i = 0; i < idx.size(); ++i) {
+        idx[i] = i;
+    }
+    root_ = build(idx, 0, idx.size(), 0);
+}
+
+void KdTree::nearest(int node, Coord xy, NearestHeap &heap) const
+{
+    if (node == -1) {
+        return;
+    }
+
+    Node const& n = nodes_[node];
+    if (!n.removed) {
+        heap.offer(squared_distance(xy, n.xy), n.key, n.id);
+    }
+
+    long long diff = static_cast<long long>(split_key(xy, n.axis)) - split_key(n.xy, n.axis);
+    int near = diff < 0 ? n.left : n.right;
+    int far = diff < 0 ? n.right : n.left;
+    nearest(near, xy, heap);
+    // Equal distances still have to be visited because of the tie-breaking
+    auto gap = static_cast<unsigned long long>(std::llabs(diff));
+    if (gap*gap <= heap.bound()) {
+        nearest(far, xy, heap);
+    }
+}
+
+void GridIndex::insert(Coord xy, StationHandle id)
+{
+    Coord cell = cell_of(xy);
+    cells_[cell].push_back({xy, coord_key(xy), id});
+    ++size_;
+
+    min_cell_ = {std::min(min_cell_.x, cell.x), std::min(min_cell_.y, cell.y)};
+    max_cell_ = {std::max(max_cell_.x, cell.x), std::max(max_cell_.y, cell.y)};
+
+    if (size_ > 2 * regrid_size_ + 16) {
+        regrid();
+    }
+}
+
+bool GridIndex::erase(Coord xy, StationHandle id)
+{
+    auto found_cell = cells_.find(cell_of(xy));
+    if (found_cell == cells_.end()) {
+        return false;
+    }
+
+    Cell& entries = (*found_cell).second;
+    auto found = std::find_if(entries.begin(), entries.end(),
+                              [&](Entry const& e){ return e.xy == xy && e.id == id; });
+    if (found == entries.end()) {
+        return false;
+    }
+
+    *found = std::move(entries.back());
+    entries.pop_back();
+    if (entries.empty()) {
+        cells_.erase(found_cell);
+    }
+    --size_;
+
+    if (4 * size_ < regrid_size_) {
+        regrid();
+    }
+    return true;
+}
+
+void GridIndex::clear()
+{
+    cells_.clear();
+    size_ = 0;
+    regrid_size_ = 0;
+    cell_shift_ = 0;
+    min_cell_ = {std::numeric_limits<int>::max(), std::numeric_limits<int>::max()};
+    max_cell_ = {std::numeric_limits<int>::min(), std::numeric_limits<int>::min()};
+}
+
+StationHandle GridIndex::find(Coord xy) const
+{
+    auto found_cell = cells_.find(cell_of(xy));
+    if (found_cell == cells_.end()) {
+        return SymbolTable::NONE;
+    }
+
+    for (auto& e : (*found_cell).second) {
+        if (e.xy == xy) {
+            return e.id;
+        }
+    }
+    return SymbolTable::NONE;
+}
+
+void GridIndex::nearest(Coord xy, NearestHeap &heap) const
+{
+    if (heap.k() == 0 || size_ == 0) {
+        return;
+    }
+
+    auto offer_cell = [&heap, xy](Cell const& entries) {
+        for (auto& e : entries) {
+            heap.offer(squared_distance(xy, e.xy), e.key, e.id);
+        }
+    };
+
+    // Expand square rings of cells around the query cell. After ring r
+    // every unvisited station is at least `gap` away from xy.
+    Coord center = cell_of(xy);
+    for (long long r = 0; ; ++r) {
+        Coord lo = {static_cast<int>(std::max<long long>(center.x - r, min_cell_.x)),
+                    static_cast<int>(std::max<long long>(center.y - r, min_cell_.y))};
+        Coord hi = {static_cast<int>(std::min<long long>(center.x + r, max_cell_.x)),
+                    static_cast<int>(std::min<long long>(center.y + r, max_cell_.y))};
+
+        bool covers_all = center.x - r <= min_cell_.x && center.y - r <= min_cell_.y &&
+                          max_cell_.x <= center.x + r && max_cell_.y <= center.y + r;
+        auto ring_cells = static_cast<unsigned long long>(8 * r + 1);
+        if (covers_all || ring_cells > cells_.size()) {
+            // Cheaper to look at the rest of the non-empty cells than at the ring
+            for (auto& i : cells_) {
+                if (std::max(std::llabs(static_cast<long long>(i.first.x) - center.x),
+                             std::llabs(static_cast<long long>(i.first.y) - center.y)) >= r) {
+                    offer_cell(i.second);
+                }
+            }
+            break;
+        }
+
+        auto offer_at = [&](long long cx, long long cy) {
+            auto found_cell = cells_.find({static_cast<int>(cx), static_cast<int>(cy)});
+            if (found_cell != cells_.end()) {
+                offer_cell((*found_cell).second);
+            }
+        };
+        for (long long cy = lo.y; cy <= hi.y; ++cy) {
+            if (cy == center.y - r || cy == center.y + r) {
+                for (long long cx = lo.x; cx <= hi.x; ++cx) {
+                    offer_at(cx, cy);
+                }
+            } else {
+                if (lo.x == center.x - r) {
+                    offer_at(lo.x, cy);
+                }
+                if (hi.x == center.x + r) {
+                    offer_at(hi.x, cy);
+                }
+            }
+        }
+
+        long long left = static_cast<long long>(xy.x) - ((center.x - r) * cell_size()) + 1;
+        long long right = (center.x + r + 1) * cell_size() - static_cast<long long>(xy.x);
+        long long down = static_cast<long long>(xy.y) - ((center.y - r) * cell_size()) + 1;
+        long long up = (center.y + r + 1) * cell_size() - static_cast<long long>(xy.y);
+        auto gap = static_cast<unsigned long long>(std::min({left, right, down, up}));
+        if (gap > std::numeric_limits<unsigned int>::max() || gap * gap > heap.bound()) {
+            break;
+        }
+    }
+}
+
+void GridIndex::regrid()
+{
+    std::vector<Entry> entries;
+    entries.reserve(size_);
+    for (auto& i : cells_) {
+        std::move(i.second.begin(), i.second.end(), std::back_inserter(entries));
+    }
+    cells_.clear();
+
+    Coord min_xy = {std::numeric_limits<int>::max(), std::numeric_limits<int>::max()};
+    Coord max_xy = {std::numeric_limits<int>::min(), std::numeric_limits<int>::min()};
+    for (auto& e : entries) {
+        min_xy = {std::min(min_xy.x, e.xy.x), std::min(min_xy.y, e.xy.y)};
+        max_xy = {std::max(max_xy.x, e.xy.x), std::max(max_xy.y, e.xy.y)};
+    }
+
+    // About two stations per cell
+    cell_shift_ = 0;
+    if (!entries.empty()) {
+        double area = (static_cast<double>(max_xy.x) - min_xy.x + 1) * (static_cast<double>(max_xy.y) - min_xy.y + 1);
+        double side = std::sqrt(2.0 * area / entries.size());
+        while (cell_shift_ < 30 && static_cast<double>(1LL << cell_shift_) < side) {
+            ++cell_shift_;
+        }
+    }
+
+    min_cell_ = {std::numeric_limits<int>::max(), std::numeric_limits<int>::max()};
+    max_cell_ = {std::numeric_limits<int>::min(), std::numeric_limits<int>::min()};
+    for (auto& e : entries) {
+        Coord cell = cell_of(e.xy);
+        min_cell_ = {std::min(min_cell_.x, cell.x), std::min(min_cell_.y, cell.y)};
+        max_cell_ = {std::max(max_cell_.x, cell.x), std::max(max_cell_.y, cell.y)};
+        cells_[cell].push_back(std::move(e));
+    }
+    regrid_size_ = size_;
+}
+
+namespace
+{
+// Smallest Morton code larger than code that is inside the box whose
+// corners have the codes zmin and zmax (BIGMIN of Tropf & Herzog)
+unsigned long long next_morton_in_box(unsigned long long code, unsigned long long zmin, unsigned long long zmax)
+{
+    unsigned long long result = 0;
+    for (int bit = 63; bit >= 0; --bit) {
+        unsigned long long mask = 1ULL << bit;
+        // Lower bits of the same dimension as this bit
+        unsigned long long lower = (bit % 2 == 0 ? 0x5555555555555555ULL : 0xAAAAAAAAAAAAAAAAULL) & (mask - 1);
+        bool c = code & mask;
+        bool lo = zmin & mask;
+        bool hi = zmax & mask;
+
+        if (!c && !lo && hi) {
+            result = (zmin | mask) & ~lower;
+            zmax = (zmax & ~mask) | lower;
+        } else if (!c && lo && hi) {
+            return zmin;
+        } else if (c && !lo && !hi) {
+            return result;
+        } else if (c && !lo && hi) {
+            zmin = (zmin | mask) & ~lower;
+        }
+    }
+    return result;
+}
+}
+
+void MortonIndex::insert(Coord xy, StationHandle id)
+{
+    pending_.push_back({morton_code(xy), xy, id});
+    if (pending_.size() >= MORTON_BUFFER_SIZE) {
+        flush_pending();
+    }
+}
+
+bool MortonIndex::erase(Coord xy, StationHandle id)
+{
+    auto code = morton_code(xy);
+    for (auto& run : runs_) {
+        auto first = std::lower_bound(run.begin(), run.end(), Entry{code, xy, {}}, by_code);
+        for (auto i = first; i != run.end() && (*i).code == code; ++i) {
+            if (!(*i).removed && (*i).id == id) {
+                (*i).removed = true;
+                ++removed_;
+                if (removed_ * 4 > stored_) {
+                    compact();
+                }
+                return true;
+            }
+        }
+    }
+
+    auto found = std::find_if(pending_.begin(), pending_.end(),
+                              [&](Entry const& e){ return e.code == code && e.id == id; });
+    if (found == pending_.end()) {
+        return false;
+    }
+    *found = std::move(pending_.back());
+    pending_.pop_back();
+    return true;
+}
+
+void MortonIndex::clear()
+{
+    runs_.clear();
+    pending_.clear();
+    stored_ = 0;
+    removed_ = 0;
+}
+
+void MortonIndex::visit_rect(Coord min, Coord max, const std::function<void (StationHandle, Coord)> &visit) const
+{
+    if (min.x > max.x || min.y > max.y) {
+        return;
+    }
+
+    auto inside = [min, max](Coord xy) {
+        return min.x <= xy.x && xy.x <= max.x && min.y <= xy.y && xy.y <= max.y;
+    };
+
+    auto zmin = morton_code(min);
+    auto zmax = morton_code(max);
+    for (auto& run : runs_) {
+        auto i = std::lower_bound(run.begin(), run.end(), Entry{zmin, min, {}}, by_code);
+        while (i != run.end() && (*i).code <= zmax) {
+            if (inside((*i).xy)) {
+                if (!(*i).removed) {
+                    visit((*i).id, (*i).xy);
+                }
+                ++i;
+            } else {
+                // Left the box, jump to where the Z curve enters it again
+                auto next = next_morton_in_box((*i).code, zmin, zmax);
+                i = std::lower_bound(i, run.end(), Entry{next, min, {}}, by_code);
+            }
+        }
+    }
+
+    for (auto& e : pending_) {
+        if (inside(e.xy)) {
+            visit(e.id, e.xy);
+        }
+    }
+}
+
+void MortonIndex::flush_pending()
+{
+    Run run(std::move(pending_));
+    pending_ = Run();
+    pending_.reserve(MORTON_BUFFER_SIZE);
+    std::sort(run.begin(), run.end(), by_code);
+    stored_ += run.size();
+
+    // Like carrying in a binary counter: a run at least half the size of
+    // the new one is merged into it
+    while (!runs_.empty() && runs_.back().size() <= 2 * run.size()) {
+        Run merged;
+        merged.reserve(runs_.back().size() + run.size());
+        std::merge(runs_.back().begin(), runs_.back().end(), run.begin(), run.end(),
+                   std::back_inserter(merged), by_code);
+        runs_.pop_back();
+        run.swap(merged);
+    }
+    runs_.push_back(std::move(run));
+}
+
+void MortonIndex::compact()
+{
+    Run all;
+    all.reserve(stored_ - removed_);
+    for (auto& run : runs_) {
+        auto middle = all.size();
+        std::copy_if(run.begin(), run.end(), std::back_inserter(all), [](Entry const& e){ return !e.removed; });
+        std::inplace_merge(all.begin(), all.begin() + middle, all.end(), by_code);
+    }
+    runs_.clear();
+    stored_ = all.size();
+    removed_ = 0;
+    if (!all.empty()) {
+        runs_.push_back(std::move(all));
+    }
+}
+
+unsigned int CoordColumns::push(Coord xy, StationHandle id)
+{
+    xs_.push_back(xy.x);
+    ys_.push_back(xy.y);
+    ids_.push_back(id);
+    if (xy.x < -SIMD_LIMIT || xy.x > SIMD_LIMIT || xy.y < -SIMD_LIMIT || xy.y > SIMD_LIMIT) {
+        simd_ok_ = false;
+    }
+    return ids_.size() - 1;
+}
+
+void CoordColumns::set(unsigned int slot, Coord xy)
+{
+    xs_[slot] = xy.x;
+    ys_[slot] = xy.y;
+    if (xy.x < -SIMD_LIMIT || xy.x > SIMD_LIMIT || xy.y < -SIMD_LIMIT || xy.y > SIMD_LIMIT) {
+        simd_ok_ = false;
+    }
+}
+
+StationHandle CoordColumns::erase(unsigned int slot)
+{
+    auto last = ids_.size() - 1;
+    if (slot != last) {
+        xs_[slot] = xs_[last];
+        ys_[slot] = ys_[last];
+        ids_[slot] = ids_[last];
+    }
+    xs_.pop_back();
+    ys_.pop_back();
+    ids_.pop_back();
+    return slot != last ? ids_[slot] : SymbolTable::NONE;
+}
+
+void CoordColumns::clear()
+{
+    xs_.clear();
+    ys_.clear();
+    ids_.clear();
+    simd_ok_ = true;
+}
+
+void CoordColumns::nearest(Coord xy, NearestHeap &heap) const
+{
+    if (heap.k() == 0) {
+        return;
+    }
+
+    std::size_t i = 0;
+    bool simd = simd_ok_ && -SIMD_LIMIT <= xy.x && xy.x <= SIMD_LIMIT && -SIMD_LIMIT <= xy.y && xy.y <= SIMD_LIMIT;
+    // Differences fit 31 bits, so their squares are computed as 64-bit
+    // products of the even and of the odd 32-bit lanes
+#if defined(__AVX2__)
+    if (simd) {
+        __m256i qx = _mm256_set1_epi32(xy.x);
+        __m256i qy = _mm256_set1_epi32(xy.y);
+        alignas(32) long long even_dist[4];
+        alignas(32) long long odd_dist[4];
+        for ( ; i + 8 <= ids_.size(); i += 8) {
+            __m256i dx = _mm256_sub_epi32(_mm256_load_si256(reinterpret_cast<__m256i const*>(xs_.data() + i)), qx);
+            __m256i dy = _mm256_sub_epi32(_mm256_load_si256(reinterpret_cast<__m256i const*>(ys_.data() + i)), qy);
+            __m256i dx_odd = _mm256_srli_epi64(dx, 32);
+            __m256i dy_odd = _mm256_srli_epi64(dy, 32);
+            __m256i even = _mm256_add_epi64(_mm256_mul_epi32(dx, dx), _mm256_mul_epi32(dy, dy));
+            __m256i odd = _mm256_add_epi64(_mm256_mul_epi32(dx_odd, dx_odd), _mm256_mul_epi32(dy_odd, dy_odd));
+
+            auto bound = std::min<unsigned long long>(heap.bound(), std::numeric_limits<long long>::max());
+            __m256i limit = _mm256_set1_epi64x(static_cast<long long>(bound));
+            int too_far = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(even, limit))) |
+                          (_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(odd, limit))) << 4);
+            if (too_far == 0xFF) {
+                continue;
+            }
+
+            _mm256_store_si256(reinterpret_cast<__m256i*>(even_dist), even);
+            _mm256_store_si256(reinterpret_cast<__m256i*>(odd_dist), odd);
+            for (int j = 0; j < 4; ++j) {
+                if (!(too_far & (1 << j))) {
+                    auto slot = i + 2*j;
+                    heap.offer(even_dist[j], coord_key({xs_[slot], ys_[slot]}), ids_[slot]);
+                }
+                if (!(too_far & (1 << (j + 4)))) {
+                    auto slot = i + 2*j + 1;
+                    heap.offer(odd_dist[j], coord_key({xs_[slot], ys_[slot]}), ids_[slot]);
+                }
+            }
+        }
+    }
+#elif defined(__SSE4_1__)
+    if (simd) {
+        __m128i qx = _mm_set1_epi32(xy.x);
+        __m128i qy = _mm_set1_epi32(xy.y);
+        alignas(16) unsigned long long even_dist[2];
+        alignas(16) unsigned long long odd_dist[2];
+        for ( ; i + 4 <= ids_.size(); i += 4) {
+            __m128i dx = _mm_sub_epi32(_mm_load_si128(reinterpret_cast<__m128i const*>(xs_.data() + i)), qx);
+            __m128i dy = _mm_sub_epi32(_mm_load_si128(reinterpret_cast<__m128i const*>(ys_.data() + i)), qy);
+            __m128i dx_odd = _mm_srli_epi64(dx, 32);
+            __m128i dy_odd = _mm_srli_epi64(dy, 32);
+            _mm_store_si128(reinterpret_cast<__m128i*>(even_dist),
+                            _mm_add_epi64(_mm_mul_epi32(dx, dx), _mm_mul_epi32(dy, dy)));
+            _mm_store_si128(reinterpret_cast<__m128i*>(odd_dist),
+                            _mm_add_epi64(_mm_mul_epi32(dx_odd, dx_odd), _mm_mul_epi32(dy_odd, dy_odd)));
+
+            for (int j = 0; j < 2; ++j) {
+                if (even_dist[j] <= heap.bound()) {
+                    auto slot = i + 2*j;
+                    heap.offer(even_dist[j], coord_key({xs_[slot], ys_[slot]}), ids_[slot]);
+                }
+                if (odd_dist[j] <= heap.bound()) {
+                    auto slot = i + 2*j + 1;
+                    heap.offer(odd_dist[j], coord_key({xs_[slot], ys_[slot]}), ids_[slot]);
+                }
+            }
+        }
+    }
+#else
+    (void)simd;
+#endif
+    offer_range(xy, i, ids_.size(), heap);
+}
+
+void CoordColumns::offer_range(Coord xy, std::size_t begin, std::size_t end, NearestHeap &heap) const
+{
+    for (auto i = begin; i < end; ++i) {
+        Coord station_xy = {xs_[i], ys_[i]};
+        auto dist = squared_distance(xy, station_xy);
+        if (dist <= heap.bound()) {
+            heap.offer(dist, coord_key(station_xy), ids_[i]);
+        }
+    }
+}
+
+// Modify the code below to implement the functionality of the class.
+// Also remove comments from the parameter names when you implement
+// an operation (Commenting out parameter name prevents compiler from
+// warning about unused parameters on operations you haven't yet implemented.)
+
+void EulerTourLca::build(const std::vector<Node> &parents)
+{
+    auto n = parents.size();
+    first_child_.assign(n + 1, 0);
+    for (auto parent : parents) {
+        if (parent != NONE) {
+            ++first_child_[parent + 1];
+        }
+    }
+    for (std::size_t v = 0; v < n; ++v) {
+        first_child_[v + 1] += first_child_[v];
+    }
+    child_list_.resize(first_child_[n]);
+    std::vector<Node> next(first_child_.begin(), first_child_.end() - 1);
+    for (Node v = 0; v < n; ++v) {
+        if (parents[v] != NONE) {
+            child_list_[next[parents[v]]++] = v;
+        }
+    }
+
+    depth_.assign(n, 0);
+    root_.assign(n, NONE);
+    first_visit_.assign(n, 0);
+    tour_.clear();
+    tour_.reserve(2 * n);
+    // Walks with an explicit stack of (node, next child to visit), so a
+    // tree as deep as it has nodes does not run out of call stack
+    std::vector<std::pair<Node, Node>> stack;
+    stack.reserve(n);
+    for (Node root = 0; root < n; ++root) {
+        if (parents[root] != NONE) {
+            continue;
+        }
+        root_[root] = root;
+        first_visit_[root] = tour_.size();
+        tour_.push_back(root);
+        stack.emplace_back(root, first_child_[root]);
+        while (!stack.empty()) {
+            Node v = stack.back().first;
+            Node next_child = stack.back().second;
+            if (next_child == first_child_[v + 1]) {
+                // Back in the parent after the last child
+                stack.pop_back();
+                if (!stack.empty()) {
+                    tour_.push_back(stack.back().first);
+                }
+                continue;
+            }
+            ++stack.back().second;
+            Node child = child_list_[next_child];
+            depth_[child] = depth_[v] + 1;
+            root_[child] = root;
+            first_visit_[child] = tour_.size();
+            tour_.push_back(child);
+            stack.emplace_back(child, first_child_[child]);
+        }
+    }
+
+    auto m = tour_.size();
+    table_.assign(tour_.begin(), tour_.end());
+    for (std::size_t len = 2, level = 1; len <= m; len *= 2, ++level) {
+        table_.resize((level + 1) * m);
+        auto previous = table_.begin() + (level - 1) * m;
+        auto current = table_.begin() + level * m;
+        for (std::size_t i = 0; i + len <= m; ++i) {
+            current[i] = shallower(previous[i], previous[i + len / 2]);
+        }
+    }
+}
+
+EulerTourLca::Node EulerTourLca::lca(Node u, Node v) const
+{
+    if (root_[u] != root_[v]) {
+        return NONE;
+    }
+    auto first = first_visit_[u];
+    auto last = first_visit_[v];
+    if (first > last) {
+        std::swap(first, last);
+    }
+    // Largest level whose ranges fit in [first, last]
+    auto level = 31 - __builtin_clz(last - first + 1);
+    auto row = table_.begin() + level * tour_.size();
+    return shallower(row[first], row[last + 1 - (1u << level)]);
+}
+
+void EulerTourLca::clear()
+{
+    first_child_.clear();
+    child_list_.clear();
+    depth_.clear();
+    root_.clear();
+    first_visit_.clear();
+    tour_.clear();
+    table_.clear();
+}
+
+void AncestorTable::build(const std::vector<Node> &parents)
+{
+    n_ = parents.size();
+    depth_.assign(n_, NONE);
+    // Depths by walking up to the first node with a known depth
+    std::vector<Node> path;
+    Node deepest = 0;
+    for (Node v = 0; v < n_; ++v) {
+        Node u = v;
+        while (depth_[u] == NONE && parents[u] != NONE) {
+            path.push_back(u);
+            u = parents[u];
+        }
+        if (depth_[u] == NONE) {
+            depth_[u] = 0;
+        }
+        for (auto d = depth_[u]; !path.empty(); path.pop_back()) {
+            depth_[path.back()] = ++d;
+        }
+        deepest = std::max(deepest, depth_[v]);
+    }
+
+    jumps_.assign(parents.begin(), parents.end());
+    for (std::size_t level = 1; (Node(1) << level) <= deepest; ++level) {
+        jumps_.resize((level + 1) * n_);
+        auto previous = jumps_.begin() + (level - 1) * n_;
+        auto current = jumps_.begin() + level * n_;
+        for (std::size_t v = 0; v < n_; ++v) {
+            current[v] = previous[v] == NONE ? NONE : previous[previous[v]];
+        }
+    }
+}
+
+AncestorTable::Node AncestorTable::kth_ancestor(Node v, Node k) const
+{
+    if (k > depth_[v]) {
+        return NONE;
+    }
+    for (std::size_t level = 0; k != 0; ++level, k >>= 1) {
+        if (k & 1) {
+            v = jumps_[level * n_ + v];
+        }
+    }
+    return v;
+}
+
+void AncestorTable::clear()
+{
+    n_ = 0;
+    depth_.clear();
+    jumps_.clear();
+}
+
+RegionTree::Index RegionTree::add(RegionID id)
+{
+    Index v = parent_.size();
+    parent_.push_back(NONE);
+    first_child_.push_back(NONE);
+    last_child_.push_back(NONE);
+    next_sibling_.push_back(NONE);
+    position_.push_back(order_.size());
+    size_.push_back(1);
+    direct_stations_.push_back(0);
+    order_.push_back(v);
+    ids_.push_back(id);
+    // The new entry sums the positions it covers before the new one
+    Index i = order_.size();
+    station_sums_.push_back(stations_before(i - 1) - stations_before(i - (i & (0u - i))));
+    return v;
+}
+
+void RegionTree::attach(Index child, Index parent)
+{
+    parent_[child] = parent;
+    if (first_child_[parent] == NONE) {
+        first_child_[parent] = child;
+    } else {
+        next_sibling_[last_child_[parent]] = child;
+    }
+    last_child_[parent] = child;
+    if (stale_) {
+        return;
+    }
+
+    Index first = position_[child];
+    Index last = first + size_[child];
+    Index target = position_[parent] + size_[parent];
+
+    // child's run is a whole tree, so it lies either before or after
+    // parent's tree and never overlaps the target
+    Index from = std::min(first, target);
+    Index to = std::max(last, target);
+    if (to - from > REGION_MOVE_MAX) {
+        stale_ = true;
+        return;
+    }
+    // The moved regions take their station counts along
+    for (Index i = from; i < to; ++i) {
+        if (direct_stations_[order_[i]] != 0) {
+            add_stations_at(i, -static_cast<int>(direct_stations_[order_[i]]));
+        }
+    }
+    if (first < target) {
+        std::rotate(order_.begin() + first, order_.begin() + last, order_.begin() + target);
+        std::rotate(ids_.begin() + first, ids_.begin() + last, ids_.begin() + target);
+    } else {
+        std::rotate(order_.begin() + target, order_.begin() + first, order_.begin() + last);
+        std::rotate(ids_.begin() + target, ids_.begin() + first, ids_.begin() + last);
+    }
+    for (Index i = from; i < to; ++i) {
+        position_[order_[i]] = i;
+        if (direct_stations_[order_[i]] != 0) {
+            add_stations_at(i, direct_stations_[order_[i]]);
+        }
+    }
+
+    add_to_ancestors(child, size_[child]);
+}
+
+void RegionTree::add_stations(Index v, int delta)
 {
-    auto range = end-start;
-    ++range;
+    direct_stations_[v] += delta;
+    if (!stale_) {
+        add_stations_at(position_[v], delta);
+    }
+}
 
-    auto num = std::uniform_int_distribution<unsigned long int>(0, range-1)(rand_engine);
+template <typename Visit>
+void RegionTree::walk_subtree(Index v, Visit visit)
+{
+    // Down to the first child when there is one, otherwise up until a
+    // region has a next sibling, without going above v
+    Index u = v;
+    while (true) {
+        visit(u);
+        ++walk_steps_;
+        if (first_child_[u] != NONE) {
+            u = first_child_[u];
+            continue;
+        }
+        while (u != v && next_sibling_[u] == NONE) {
+            u = parent_[u];
+        }
+        if (u == v) {
+            return;
+        }
+        u = next_sibling_[u];
+    }
+}
 
-    return static_cast<Type>(start+num);
+std::vector<RegionID> RegionTree::subregions(Index v)
+{
+    if (use_order()) {
+        return {ids_.data() + position_[v] + 1, ids_.data() + position_[v] + size_[v]};
+    }
+
+    // order_ and ids_ still agree with position_ for the regions' ids
+    std::vector<RegionID> result;
+    walk_subtree(v, [this, v, &result](Index u) {
+        if (u != v) {
+            result.push_back(ids_[position_[u]]);
+        }
+    });
+    return result;
 }
 
-// Modify the code below to implement the functionality of the class.
-// Also remove comments from the parameter names when you implement
-// an operation (Commenting out parameter name prevents compiler from
-// warning about unused parameters on operations you haven't yet implemented.)
+bool RegionTree::contains(Index outer, Index inner)
+{
+    if (use_order()) {
+        return position_[outer] < position_[inner] && position_[inner] < position_[outer] + size_[outer];
+    }
+
+    for (Index u = parent_[inner]; u != NONE; u = parent_[u]) {
+        ++walk_steps_;
+        if (u == outer) {
+            return true;
+        }
+    }
+    return false;
+}
+
+RegionTree::Index RegionTree::subregion_count(Index v)
+{
+    if (use_order()) {
+        return size_[v] - 1;
+    }
+
+    Index count = 0;
+    walk_subtree(v, [&count](Index) { ++count; });
+    return count - 1;
+}
+
+RegionTree::Index RegionTree::station_count(Index v)
+{
+    if (use_order()) {
+        return stations_before(position_[v] + size_[v]) - stations_before(position_[v]);
+    }
+
+    Index count = 0;
+    walk_subtree(v, [this, &count](Index u) { count += direct_stations_[u]; });
+    return count;
+}
+
+void RegionTree::add_to_ancestors(Index v, Index size)
+{
+    // A deep parent chain is left to update() as well
+    Index steps = 0;
+    for (Index u = parent_[v]; u != NONE; u = parent_[u]) {
+        if (++steps > REGION_MOVE_MAX) {
+            stale_ = true;
+            return;
+        }
+        size_[u] += size;
+    }
+}
+
+int RegionTree::stations_before(Index position) const
+{
+    int sum = 0;
+    for (Index i = position; i > 0; i &= i - 1) {
+        sum += station_sums_[i - 1];
+    }
+    return sum;
+}
+
+void RegionTree::add_stations_at(Index position, int delta)
+{
+    for (Index i = position + 1; i <= station_sums_.size(); i += i & (0u - i)) {
+        station_sums_[i - 1] += delta;
+    }
+}
+
+bool RegionTree::use_order()
+{
+    if (stale_ && walk_steps_ >= parent_.size()) {
+        update();
+    }
+    return !stale_;
+}
+
+void RegionTree::update()
+{
+    // order_ and ids_ still agree with position_, only the tree has changed
+    Index n = parent_.size();
+    std::vector<RegionID> ids(n);
+    for (Index v = 0; v < n; ++v) {
+        ids[v] = ids_[position_[v]];
+    }
+
+    order_.clear();
+    for (Index root = 0; root < n; ++root) {
+        if (parent_[root] == NONE) {
+            walk_subtree(root, [this](Index u) {
+                position_[u] = order_.size();
+                order_.push_back(u);
+            });
+        }
+    }
+
+    // Subtree sizes, every region after all of its subregions
+    std::fill(size_.begin(), size_.end(), 1);
+    for (auto i = order_.rbegin(); i != order_.rend(); ++i) {
+        if (parent_[*i] != NONE) {
+            size_[parent_[*i]] += size_[*i];
+        }
+    }
+    for (Index i = 0; i < n; ++i) {
+        ids_[i] = ids[order_[i]];
+    }
+
+    // Every Fenwick entry passes its sum on to the next entry covering it
+    for (Index i = 1; i <= n; ++i) {
+        station_sums_[i - 1] = direct_stations_[order_[i - 1]];
+    }
+    for (Index i = 1; i <= n; ++i) {
+        Index up = i + (i & (0u - i));
+        if (up <= n) {
+            station_sums_[up - 1] += station_sums_[i - 1];
+        }
+    }
+    stale_ = false;
+    walk_steps_ = 0;
+}
+
+void RegionTree::clear()
+{
+    parent_.clear();
+    first_child_.clear();
+    last_child_.clear();
+    next_sibling_.clear();
+    position_.clear();
+    size_.clear();
+    direct_stations_.clear();
+    station_sums_.clear();
+    order_.clear();
+    ids_.clear();
+    stale_ = false;
+    walk_steps_ = 0;
+}
 
-Datastructures::Datastructures()
+Datastructures::Datastructures(std::pmr::memory_resource *upstream)
+    : arena(upstream),
+      station(&arena),
+      station_coord_index(StationCoordLess{&station}, &arena),
+      station_name_index(StationNameLess{&station}, &arena),
+      region(&arena),
+      region_id_vec(&arena)
 {
 
 }
@@ -46,7 +1298,7 @@ Datastructures::~Datastructures()
 */
 unsigned int Datastructures::station_count()
 {
-    return station.size();
+    return station_total;
 }
 
 /**
@@ -55,12 +1307,33 @@ unsigned int Datastructures::station_count()
 */
 void Datastructures::clear_all()
 {
+    // Deallocating from the arena does nothing, so emptying the arena
+    // backed containers frees nothing one by one. They must not keep any
+    // capacity, the whole arena is given back right after.
     station.clear();
+    station_total = 0;
+    ++name_order_version;
+    ++coord_order_version;
+    alphabetical_list.clear();
+    distance_list.clear();
     region.clear();
-    station_coord_map.clear();
-    station_name_map.clear();
-    result_distance_increasing.clear();
-    result_alphabeltically.clear();
+    region_id_vec = std::pmr::vector<RegionID>(&arena);
+    region_tree.clear();
+    region_lca.clear();
+    region_ancestors.clear();
+    region_indexes_size = 0;
+    region_indexes_stale = true;
+    region_walk_steps = 0;
+    station_coord_index.clear();
+    station_name_index.clear();
+    unindexed_stations.clear();
+    arena.release();
+
+    station_ids.clear();
+    train_ids.clear();
+    station_index.clear();
+    station_morton.clear();
+    station_coords.clear();
 }
 
 /**
@@ -70,8 +1343,11 @@ void Datastructures::clear_all()
 std::vector<StationID> Datastructures::all_stations()
 {
     std::vector<StationID> result;
-    for (auto& i: station){
-        result.push_back(i.first);
+    result.reserve(station_total);
+    for (StationHandle h = 0; h < station.size(); ++h){
+        if (station.in_use[h]) {
+            result.push_back(station_ids.name(h));
+        }
     }
     return result;
 }
@@ -85,21 +1361,24 @@ std::vector<StationID> Datastructures::all_stations()
  * @return If there already is a station with the given id, nothing 
  * is done and false is returned, otherwise true is returned
 */
-bool Datastructures::add_station(StationID id, const Name& name, Coord xy)
+bool Datastructures::add_station(std::string_view id, const Name& name, Coord xy)
 {
-    auto found_station = station.find(id);
-    if (found_station == station.end()) {
-        
-        Station_Info info;
-        info.name = name;
-        info.xy = xy;
-
-        station.insert({id, info});
-        station_coord_map[xy] = id;
-        station_name_map[name] = id;
+    if (station_ids.find(id) == SymbolTable::NONE) {
+
+        StationHandle h = station_ids.intern(id);
+        station.open(h);
+        station.names[h] = name;
+        station.xys[h] = xy;
+        station.xy_keys[h] = coord_key(xy);
+        station.coord_slots[h] = station_coords.push(xy, h);
+        ++station_total;
+        ++name_order_version;
+        ++coord_order_version;
+
+        unindexed_stations.push_back(h);
+        station_index.insert(xy, h);
+        station_morton.insert(xy, h);
 
-        cache_station_alphabeltically = true;
-        cache_station_distance_increasing = true;
         return true;
     }
     return false;
@@ -111,14 +1390,14 @@ bool Datastructures::add_station(StationID id, const Name& name, Coord xy)
  * @return Returns the name and type of the station with the given
  * ID, or NO_NAME if such a station doesn't exist.
 */
-Name Datastructures::get_station_name(StationID id)
+Name Datastructures::get_station_name(std::string_view id)
 {
-    auto founded_station = station.find(id);
-    if (founded_station == station.end()){
+    auto h = station_ids.find(id);
+    if (h == SymbolTable::NONE){
         return NO_NAME;
     }
 
-    return (*founded_station).second.name;
+    return Name(station.names[h]);
 }
 
 /**
@@ -128,14 +1407,14 @@ Name Datastructures::get_station_name(StationID id)
  * @return Returns the name and type of the station with the given
  * ID, or NO_NAME if such a station doesn't exist.
 */
-Coord Datastructures::get_station_coordinates(StationID id)
+Coord Datastructures::get_station_coordinates(std::string_view id)
 {
-    auto founded_station = station.find(id);
-    if (founded_station == station.end()){
+    auto h = station_ids.find(id);
+    if (h == SymbolTable::NONE){
         return NO_COORD;
     }
 
-    return (*founded_station).second.xy;
+    return station.xys[h];
 }
 
 /**
@@ -146,16 +1425,7 @@ Coord Datastructures::get_station_coordinates(StationID id)
 */
 std::vector<StationID> Datastructures::stations_alphabetically()
 {
-    if (cache_station_alphabeltically == true) {
-        std::vector<StationID> r;
-        r.reserve(station.size());
-        for (auto &i : station_name_map){
-        r.push_back(i.second);
-        }
-        result_alphabeltically = r;
-    }
-    cache_station_alphabeltically = false;
-    return result_alphabeltically;
+    return stations_alphabetically_view().ids();
 }
 
 /**
@@ -168,18 +1438,49 @@ std::vector<StationID> Datastructures::stations_alphabetically()
 */
 std::vector<StationID> Datastructures::stations_distance_increasing()
 {
-    if (cache_station_distance_increasing == true) {
-        std::vector<StationID> r;
-        r.reserve(station.size());
-        for (auto &i : station_coord_map){
-        r.push_back(i.second);
+    return stations_distance_increasing_view().ids();
+}
+
+/**
+ * @brief stations_alphabetically_view is stations_alphabetically without
+ * copying the list
+ * @return read-only view of the station IDs sorted by station name. The
+ * view is valid() until a station is added or removed
+*/
+StationListView Datastructures::stations_alphabetically_view()
+{
+    // New stations reach station_name_index here, the rest of it is kept sorted by every mutation
+    if (alphabetical_list_version != name_order_version) {
+        index_new_stations();
+        alphabetical_list.clear();
+        alphabetical_list.reserve(station_total);
+        for (auto h : station_name_index){
+            alphabetical_list.push_back(station_ids.name(h));
         }
-        result_distance_increasing = r;
-        return r;
+        alphabetical_list_version = name_order_version;
     }
+    return {alphabetical_list, alphabetical_list_version, &name_order_version};
+}
 
-    cache_station_distance_increasing = false;
-    return result_distance_increasing;
+/**
+ * @brief stations_distance_increasing_view is stations_distance_increasing
+ * without copying the list
+ * @return read-only view of the station IDs sorted by their coordinates.
+ * The view is valid() until a station is added, removed or moved
+*/
+StationListView Datastructures::stations_distance_increasing_view()
+{
+    // New stations reach station_coord_index here, the rest of it is kept sorted by every mutation
+    if (distance_list_version != coord_order_version) {
+        index_new_stations();
+        distance_list.clear();
+        distance_list.reserve(station_total);
+        for (auto h : station_coord_index){
+            distance_list.push_back(station_ids.name(h));
+        }
+        distance_list_version = coord_order_version;
+    }
+    return {distance_list, distance_list_version, &coord_order_version};
 }
 
 /**
@@ -191,12 +1492,8 @@ std::vector<StationID> Datastructures::stations_distance_increasing()
 */
 StationID Datastructures::find_station_with_coord(Coord xy)
 {
-    const auto foundStation = station_coord_map.find(xy);
-    if (foundStation == station_coord_map.end()){
-        return NO_STATION;
-    }
-
-    return foundStation->second;
+    auto found = station_index.find(xy);
+    return found == SymbolTable::NONE ? NO_STATION : station_ids.name(found);
 }
 
 /**
@@ -206,16 +1503,24 @@ StationID Datastructures::find_station_with_coord(Coord xy)
  * @param newcoord new coordinate of station
  * @return If such station doesn't exist, returns false, otherwise true.
 */
-bool Datastructures::change_station_coord(StationID id, Coord newcoord)
+bool Datastructures::change_station_coord(std::string_view id, Coord newcoord)
 {
-    auto found_station = station.find(id);
-    if (found_station == station.end()){
+    auto h = station_ids.find(id);
+    if (h == SymbolTable::NONE){
         return false;
     }
-    auto temp = (*found_station).second.xy;
-    (*found_station).second.xy = newcoord;
-    station_coord_map.erase(temp);
-    station_coord_map[newcoord] = id;
+    index_new_stations();
+    auto temp = station.xys[h];
+    station_coord_index.erase(h);
+    station.xys[h] = newcoord;
+    station.xy_keys[h] = coord_key(newcoord);
+    station_coord_index.insert(h);
+    station_index.erase(temp, h);
+    station_index.insert(newcoord, h);
+    station_morton.erase(temp, h);
+    station_morton.insert(newcoord, h);
+    station_coords.set(station.coord_slots[h], newcoord);
+    ++coord_order_version;
     return true;
 }
 
@@ -229,15 +1534,22 @@ bool Datastructures::change_station_coord(StationID id, Coord newcoord)
  * been added (train already leaves from given station at the given time),
  * returns false, otherwise true
 */
-bool Datastructures::add_departure(StationID stationid, TrainID trainid, Time time)
+bool Datastructures::add_departure(std::string_view stationid, std::string_view trainid, Time time)
 {
-    auto found_station = station.find(stationid);
-    if (station.find(stationid) == station.end()) {
+    auto h = station_ids.find(stationid);
+    if (h == SymbolTable::NONE) {
         return false;
     }
 
-    std::pair<Time, TrainID> departure (time, trainid);
-    (*found_station).second.schedule.push_back(departure);
+    // Schedule is kept sorted by (time, train id)
+    auto& schedule = station.schedules[h];
+    Departure departure {time, train_ids.intern(trainid)};
+    auto position = std::lower_bound(schedule.begin(), schedule.end(), departure,
+                                     [this](Departure const& a, Departure const& b){ return departure_before(a, b); });
+    if (position != schedule.end() && (*position).time == time && (*position).train == departure.train) {
+        return false;
+    }
+    schedule.insert(position, departure);
     return true;
 }
 
@@ -250,19 +1562,22 @@ bool Datastructures::add_departure(StationID stationid, TrainID trainid, Time ti
  * @return If such a station or such departure from the station 
  * doesn't exist, returns false, otherwise true.
 */
-bool Datastructures::remove_departure(StationID stationid, TrainID trainid, Time time)
+bool Datastructures::remove_departure(std::string_view stationid, std::string_view trainid, Time time)
 {
-    auto found_station = station.find(stationid);
-    if (found_station== station.end()) {
+    auto h = station_ids.find(stationid);
+    auto train = train_ids.find(trainid);
+    if (h == SymbolTable::NONE || train == SymbolTable::NONE) {
         return false;
     } 
 
-    std::pair<Time, TrainID> departure (time, trainid);
-    auto re = std::find((*found_station).second.schedule.begin(), (*found_station).second.schedule.end(), departure);
-    if (re == (*found_station).second.schedule.end()) {
+    auto& schedule = station.schedules[h];
+    Departure departure {time, train};
+    auto re = std::lower_bound(schedule.begin(), schedule.end(), departure,
+                               [this](Departure const& a, Departure const& b){ return departure_before(a, b); });
+    if (re == schedule.end() || (*re).time != time || (*re).train != train) {
         return false;
     }
-    station.at(stationid).schedule.erase(re);
+    schedule.erase(re);
     return true;
 
 }
@@ -272,24 +1587,43 @@ bool Datastructures::remove_departure(StationID stationid, TrainID trainid, Time
  * from the given station at or after the given time
  * @param station station id
  * @param time input time 
+ * @param limit maximum number of departures returned
  * @return vector<pair<Time,TrainID> If trains have the same departure 
  * time, they should be sorted based on their ids. If the given station 
  * doesn't exist, pair {NO_TIME,NO_TRAIN} is returned.  Departures 
  * should be sorted based on departure time
 */
-std::vector<std::pair<Time, TrainID>> Datastructures::station_departures_after(StationID stationid, Time time)
+std::vector<std::pair<Time, TrainID>> Datastructures::station_departures_after(std::string_view stationid, Time time, std::size_t limit)
 {
-    std::vector<std::pair<Time, TrainID>> r;
-    auto found_station = station.find(stationid);
+    auto departures = station_departures_after_view(stationid, time, limit);
+    return {departures.begin(), departures.end()};
+}
 
-    if (found_station == station.end()) {
-        std::pair<Time, TrainID> departure (NO_TIME, NO_TRAIN);
-        r.push_back(departure);
-        return r;
+/**
+ * @brief station_departures_after_view is station_departures_after
+ * without copying the departures
+ * @param station station id
+ * @param time input time
+ * @param limit maximum number of departures in the view
+ * @return view of the departures at or after time, sorted by time and
+ * train id. If the given station doesn't exist, the view has the single
+ * pair {NO_TIME,NO_TRAIN}
+*/
+DepartureRange Datastructures::station_departures_after_view(std::string_view stationid, Time time, std::size_t limit)
+{
+    static Departure const no_departure[] = {{NO_TIME, SymbolTable::NONE}};
+
+    auto h = station_ids.find(stationid);
+    if (h == SymbolTable::NONE) {
+        return {std::begin(no_departure), std::end(no_departure), &train_ids};
     }
-    std::copy_if((*found_station).second.schedule.begin(), (*found_station).second.schedule.end(), std::back_inserter(r),
-                 [time](auto& departure){return departure.first >= time;});
-    return r;
+
+    auto& schedule = station.schedules[h];
+    auto first = std::lower_bound(schedule.begin(), schedule.end(), time,
+                                  [](Departure const& d, Time t){ return d.time < t; });
+    auto count = std::min<std::size_t>(limit, schedule.end() - first);
+    auto begin = schedule.data() + (first - schedule.begin());
+    return {begin, begin + count, &train_ids};
 }
 
 /**
@@ -305,11 +1639,12 @@ std::vector<std::pair<Time, TrainID>> Datastructures::station_departures_after(S
 */
 bool Datastructures::add_region(RegionID id, const Name &name, std::vector<Coord> coords)
 {
-    if (region.find(id) == region.end()) {
-        Region_Info info;
+    auto added = region.try_emplace(id);
+    if (added.second) {
+        Region_Info& info = (*added.first).second;
         info.name = name;
-        info.xy_vec = coords;
-        region.insert({id, info});
+        info.xy_vec.assign(coords.begin(), coords.end());
+        info.index = region_tree.add(id);
         region_id_vec.push_back(id);
         return true;
     }
@@ -324,7 +1659,7 @@ bool Datastructures::add_region(RegionID id, const Name &name, std::vector<Coord
 */
 std::vector<RegionID> Datastructures::all_regions()
 {
-    return region_id_vec;
+    return {region_id_vec.begin(), region_id_vec.end()};
 }
 
 /**
@@ -340,7 +1675,7 @@ Name Datastructures::get_region_name(RegionID id)
         return NO_NAME;
     }
 
-    return region.at(id).name;
+    return Name(region.at(id).name);
 }
 
 /**
@@ -359,7 +1694,8 @@ std::vector<Coord> Datastructures::get_region_coords(RegionID id)
         return r;
     }
 
-    return (*found_region).second.xy_vec;
+    auto& coords = (*found_region).second.xy_vec;
+    return {coords.begin(), coords.end()};
 }
 
 /**
@@ -383,8 +1719,9 @@ bool Datastructures::add_subregion_to_region(RegionID id, RegionID parentid)
         return false;
     }
 
-    (*parent_region).second.childrendID.push_back(id);
     (*child_region).second.parentID = parentid;
+    region_tree.attach((*child_region).second.index, (*parent_region).second.index);
+    region_indexes_stale = true;
     return true;
 }
 
@@ -396,43 +1733,23 @@ bool Datastructures::add_subregion_to_region(RegionID id, RegionID parentid)
  * station already belongs to some region, nothing is done and false is 
  * returned, otherwise true is returned.
 */
-bool Datastructures::add_station_to_region(StationID id, RegionID parentid)
+bool Datastructures::add_station_to_region(std::string_view id, RegionID parentid)
 {
-    auto found_station = station.find(id);
+    auto h = station_ids.find(id);
     auto found_region = region.find(parentid);
-    if (found_station == station.end() || found_region == region.end()){
+    if (h == SymbolTable::NONE || found_region == region.end()){
         return false;
     }
 
-    if ((*found_station).second.regionParent != NO_REGION) {
+    if (station.region_parents[h] != NO_REGION) {
         return false;
     }
 
-    (*found_station).second.regionParent = parentid;
+    station.region_parents[h] = parentid;
+    region_tree.add_stations((*found_region).second.index, 1);
     return true;
 }
 
-void Datastructures::recursive_add_subregion(std::vector<RegionID> &subregion_Id, std::vector<RegionID> &r)
-{
-    if (subregion_Id.size() == 0) {
-        return;
-    }
-
-    r.insert(r.end(), subregion_Id.begin(), subregion_Id.end());
-    for (auto &i : subregion_Id) {
-        recursive_add_subregion(region.at(i).childrendID, r);
-    }
-
-}
-
-void Datastructures::recursive_add_parent_region(RegionID &parent_Id, std::vector<RegionID>&r){
-    if (parent_Id == NO_REGION){
-        return;
-    }
-    r.push_back(parent_Id);
-    recursive_add_parent_region(region.at(parent_Id).parentID, r);
-}
-
 /**
  * @brief station_in_regions finds a list of regions to which the given 
  * station belongs either directly or indirectly
@@ -442,108 +1759,446 @@ void Datastructures::recursive_add_parent_region(RegionID &parent_Id, std::vecto
  * belongs to, etc. If no station with the given ID exists, a
  * vector with a single element NO_REGION is returned. 
 */
-std::vector<RegionID> Datastructures::station_in_regions(StationID id)
+std::vector<RegionID> Datastructures::station_in_regions(std::string_view id)
 {
     std::vector<RegionID> r;
 
-    auto found_station = station.find(id);
-    if (found_station == station.end()){
+    auto h = station_ids.find(id);
+    if (h == SymbolTable::NONE){
         r = {NO_REGION};
         return r;
     }
 
-    recursive_add_parent_region((*found_station).second.regionParent, r);
+    auto parent = station.region_parents[h];
+    if (parent == NO_REGION) {
+        return r;
+    }
+    for (auto i = region.at(parent).index; i != RegionTree::NONE; i = region_tree.parent(i)) {
+        r.push_back(region_id_vec[i]);
+    }
     return r;
 }
 
+/**
+ * @brief all_subregions_of_region lists the subregions of the given
+ * region, directly or indirectly
+ * @param id region id
+ * @return Returns the subregions in any order, or a vector with the
+ * single element NO_REGION if the region doesn't exist
+*/
 std::vector<RegionID> Datastructures::all_subregions_of_region(RegionID id)
 {
-    std::vector<RegionID> r;
-    if (region.find(id) == region.end()){
-        r = {NO_REGION};
-        return r;
+    auto found = region.find(id);
+    if (found == region.end()){
+        return {NO_REGION};
     }
-    recursive_add_subregion(region.at(id).childrendID, r);
-    return r;
+    return region_tree.subregions((*found).second.index);
 }
 
-std::vector<StationID> Datastructures::stations_closest_to(Coord xy)
+/**
+ * @brief stations_closest_to lists the stations closest to the given
+ * coordinate
+ * @param xy coordinate to measure the distances from
+ * @param k maximum number of stations returned
+ * @return Returns at most k stations in increasing order of distance
+ * from xy. Stations at the same distance are ordered like in
+ * stations_distance_increasing
+*/
+std::vector<StationID> Datastructures::stations_closest_to(Coord xy, std::size_t k)
 {
-    auto MAX = std::numeric_limits<unsigned long long>::max();
-
-    std::vector<StationID> result;
-    result.reserve(50);
-    auto dis1 = MAX;
-    auto dis2 = MAX;
-    auto dis3 = MAX;
+    NearestHeap heap(k, std::numeric_limits<unsigned long long>::max(), station_ids);
+    station_index.nearest(xy, heap);
+    return station_names(heap.take());
+}
 
-    
-    auto position = result.begin();
+/**
+ * @brief stations_closest_to_batch runs stations_closest_to for many
+ * coordinates at once. The coordinates are searched in Morton order so
+ * that consecutive searches walk the same parts of the index, and large
+ * batches are split between threads.
+ * @param points coordinates to measure the distances from
+ * @param k maximum number of stations returned per coordinate
+ * @return Returns for each coordinate, in the order given, the same
+ * stations as stations_closest_to(point, k)
+*/
+std::vector<std::vector<StationID>> Datastructures::stations_closest_to_batch(const std::vector<Coord> &points, std::size_t k)
+{
+    std::vector<std::vector<StationID>> result(points.size());
 
-    for (auto &i: station_coord_map){
-        unsigned long long dis = (i.first.x-xy.x)*(i.first.x-xy.x) + (i.first.y-xy.y)*(i.first.y-xy.y);
+    std::vector<std::pair<unsigned long long, std::size_t>> order;
+    order.reserve(points.size());
+    for (std::size_t i = 0; i < points.size(); ++i) {
+        order.push_back({morton_code(points[i]), i});
+    }
+    std::sort(order.begin(), order.end());
+
+    auto search = [&](std::size_t begin, std::size_t end) {
+        for (auto i = begin; i < end; ++i) {
+            auto point = order[i].second;
+            NearestHeap heap(k, std::numeric_limits<unsigned long long>::max(), station_ids);
+            station_index.nearest(points[point], heap);
+            result[point] = station_names(heap.take());
+        }
+    };
+
+    // Searches only read the index, so the chunks can run side by side
+    std::size_t threads = std::min<std::size_t>(std::max(1u, std::thread::hardware_concurrency()),
+                                                points.size() / BATCH_POINTS_PER_THREAD);
+    if (threads <= 1) {
+        search(0, order.size());
+        return result;
+    }
 
-        if ( dis < dis1) {
-            dis3 = dis2;
-            dis2 = dis1;
-            dis1 = dis;
-            result.insert(position, i.second); 
+    std::vector<std::thread> workers;
+    workers.reserve(threads - 1);
+    ThreadJoiner joiner(workers);
+    auto chunk = (order.size() + threads - 1) / threads;
+    for (std::size_t begin = chunk; begin < order.size(); begin += chunk) {
+        auto end = std::min(begin + chunk, order.size());
+        try {
+            workers.emplace_back(search, begin, end);
+        } catch (std::system_error const&) {
+            // No more threads to be had, this chunk runs here instead
+            search(begin, end);
+        }
+    }
+    search(0, chunk);
+    joiner.join();
+    return result;
+}
 
-        } else if (dis < dis2) {
-            dis3 = dis2;
-            dis2 = dis;
-            result.insert(position+1, i.second);
+/**
+ * @brief stations_closest_to_bruteforce lists the stations closest to the
+ * given coordinate by computing the distance to every station
+ * @param xy coordinate to measure the distances from
+ * @param k maximum number of stations returned
+ * @return Same result as stations_closest_to(xy, k)
+*/
+std::vector<StationID> Datastructures::stations_closest_to_bruteforce(Coord xy, std::size_t k)
+{
+    NearestHeap heap(k, std::numeric_limits<unsigned long long>::max(), station_ids);
+    station_coords.nearest(xy, heap);
+    return station_names(heap.take());
+}
 
-        } else if (dis < dis3) {
-            dis3 = dis;
-            result.insert(position+2, i.second);
-        }
-        if(result.size() > 3) {
-            result.pop_back();
-        }
+/**
+ * @brief stations_within_radius lists the stations at most the given
+ * distance away from the given coordinate
+ * @param xy coordinate to measure the distances from
+ * @param radius maximum distance of the returned stations
+ * @param k maximum number of stations returned
+ * @return Returns at most k stations in increasing order of distance
+ * from xy, or an empty vector if radius is negative
+*/
+std::vector<StationID> Datastructures::stations_within_radius(Coord xy, Distance radius, std::size_t k)
+{
+    if (radius < 0) {
+        return {};
     }
-    result.shrink_to_fit();
+    auto r = static_cast<unsigned long long>(radius);
+    NearestHeap heap(k, r*r, station_ids);
+    station_index.nearest(xy, heap);
+    return station_names(heap.take());
+}
+
+/**
+ * @brief stations_in_rect lists the stations inside the given rectangle
+ * @param min corner of the rectangle with the smallest coordinates
+ * @param max corner of the rectangle with the largest coordinates
+ * @return Returns the stations whose coordinates are between min and
+ * max (inclusive) in any (arbitrary) order
+*/
+std::vector<StationID> Datastructures::stations_in_rect(Coord min, Coord max)
+{
+    std::vector<StationID> result;
+    station_morton.visit_rect(min, max, [this, &result](StationHandle h, Coord){
+        result.push_back(station_ids.name(h));
+    });
     return result;
 }
 
-bool Datastructures::remove_station(StationID id)
+/**
+ * @brief for_each_station_in_rect calls the given function for every
+ * station inside the given rectangle without collecting them first
+ * @param min corner of the rectangle with the smallest coordinates
+ * @param max corner of the rectangle with the largest coordinates
+ * @param visit function called with the id and coordinates of each
+ * station between min and max (inclusive), in any (arbitrary) order
+*/
+void Datastructures::for_each_station_in_rect(Coord min, Coord max, std::function<void(StationID const&, Coord)> const& visit)
+{
+    station_morton.visit_rect(min, max, [this, &visit](StationHandle h, Coord xy){ visit(station_ids.name(h), xy); });
+}
+
+bool Datastructures::remove_station(std::string_view id)
 {
-    auto found_station = station.find(id);
-    if (found_station == station.end()){
+    auto h = station_ids.find(id);
+    if (h == SymbolTable::NONE){
         return false;
     }
 
-    station_coord_map.erase((*found_station).second.xy);
-    station_name_map.erase((*found_station).second.name);
-    station.erase(id);
-    cache_station_alphabeltically = true;
-    cache_station_distance_increasing = true;
+    index_new_stations();
+    station_coord_index.erase(h);
+    station_name_index.erase(h);
+    station_index.erase(station.xys[h], h);
+    station_morton.erase(station.xys[h], h);
+    auto slot = station.coord_slots[h];
+    auto moved = station_coords.erase(slot);
+    if (moved != SymbolTable::NONE) {
+        station.coord_slots[moved] = slot;
+    }
+    if (station.region_parents[h] != NO_REGION) {
+        region_tree.add_stations(region.at(station.region_parents[h]).index, -1);
+    }
+    // The slot goes to the next station added
+    station.close(h);
+    station_ids.release(h);
+    --station_total;
+    ++name_order_version;
+    ++coord_order_version;
     return true;
 }
 
-void Datastructures::find_all_parent_region(RegionID id, std::unordered_set<RegionID> &r) {
-    auto e = region.at(id).parentID;
-    if (e == NO_REGION) {
-        return;
+/**
+ * @brief common_parent_of_regions finds the closest region that both
+ * given regions belong to, directly or indirectly
+ * @param id1 first region id
+ * @param id2 second region id
+ * @return Returns the closest common parent region, or NO_REGION if
+ * either region doesn't exist or they have no common parent. A region
+ * doesn't count as its own parent
+*/
+RegionID Datastructures::common_parent_of_regions(RegionID id1, RegionID id2)
+{
+    auto region1 = region.find(id1);
+    auto region2 = region.find(id2);
+    if (region1 == region.end() || region2 == region.end()) {
+        return NO_REGION;
+    }
+
+    auto index1 = (*region1).second.index;
+    auto index2 = (*region2).second.index;
+    RegionTree::Index ancestor;
+    if (!use_region_indexes()) {
+        ancestor = walk_common_ancestor(index1, index2);
+    } else if (index1 < region_indexes_size && index2 < region_indexes_size) {
+        ancestor = region_lca.lca(index1, index2);
+    } else {
+        // A region added after the indexes has no parent or subregions
+        ancestor = index1 == index2 ? index1 : RegionTree::NONE;
+    }
+    if (ancestor == RegionTree::NONE) {
+        return NO_REGION;
+    }
+    // When one region contains the other, the answer is one level higher
+    auto common = region_id_vec[ancestor];
+    if (common == id1 || common == id2) {
+        return region.at(common).parentID;
     }
-   r.insert(e);
-   find_all_parent_region(e, r);
+    return common;
 }
 
-RegionID Datastructures::common_parent_of_regions(RegionID id1, RegionID id2)
+/**
+ * @brief region_ancestor finds the region k levels above the given one
+ * @param id region id
+ * @param k number of levels to go up, 0 gives id itself
+ * @return Returns the k-th ancestor of the region, or NO_REGION if the
+ * region doesn't exist or has fewer than k ancestors
+*/
+RegionID Datastructures::region_ancestor(RegionID id, unsigned int k)
 {
-    if (region.find(id1) == region.end() || region.find(id2) == region.end()) { 
+    auto found = region.find(id);
+    if (found == region.end()) {
         return NO_REGION;
     }
-    std::unordered_set<RegionID> r;
-    find_all_parent_region(id1, r);
 
-    auto parent2 = region.at(id2).parentID;
-    while (parent2 != NO_REGION) {
-        if (r.find(parent2) != r.end()) {
-            return parent2;
+    auto ancestor = (*found).second.index;
+    if (!use_region_indexes()) {
+        for (; k > 0 && ancestor != RegionTree::NONE; --k) {
+            ancestor = region_tree.parent(ancestor);
+            ++region_walk_steps;
+        }
+    } else if (ancestor < region_indexes_size) {
+        ancestor = region_ancestors.kth_ancestor(ancestor, k);
+    } else if (k > 0) {
+        ancestor = RegionTree::NONE;
+    }
+    return ancestor == RegionTree::NONE ? NO_REGION : region_id_vec[ancestor];
+}
+
+/**
+ * @brief region_depth tells how many regions the given region is
+ * inside of
+ * @param id region id
+ * @return Returns the depth of the region, 0 for a region that is not a
+ * subregion, or NO_VALUE if the region doesn't exist
+*/
+int Datastructures::region_depth(RegionID id)
+{
+    auto found = region.find(id);
+    if (found == region.end()) {
+        return NO_VALUE;
+    }
+
+    auto index = (*found).second.index;
+    if (!use_region_indexes()) {
+        return walk_region_depth(index);
+    }
+    return index < region_indexes_size ? region_ancestors.depth(index) : 0;
+}
+
+/**
+ * @brief is_region_ancestor tells whether a region contains another
+ * one directly or indirectly
+ * @param ancestor region id of the possible ancestor
+ * @param id region id
+ * @return Returns true if id is a subregion of ancestor, directly or
+ * indirectly. A region is not its own ancestor, and false is returned
+ * if either region doesn't exist
+*/
+bool Datastructures::is_region_ancestor(RegionID ancestor, RegionID id)
+{
+    auto found_ancestor = region.find(ancestor);
+    auto found = region.find(id);
+    if (found_ancestor == region.end() || found == region.end()) {
+        return false;
+    }
+    return region_tree.contains((*found_ancestor).second.index, (*found).second.index);
+}
+
+/**
+ * @brief count_stations_in_region counts the stations that belong to
+ * the given region directly or through its subregions
+ * @param id region id
+ * @return Returns the number of stations, or NO_VALUE if the region
+ * doesn't exist
+*/
+int Datastructures::count_stations_in_region(RegionID id)
+{
+    auto found = region.find(id);
+    if (found == region.end()) {
+        return NO_VALUE;
+    }
+    return region_tree.station_count((*found).second.index);
+}
+
+/**
+ * @brief count_subregions_of_region counts the subregions of the given
+ * region, directly or indirectly
+ * @param id region id
+ * @return Returns the number of subregions, or NO_VALUE if the region
+ * doesn't exist
+*/
+int Datastructures::count_subregions_of_region(RegionID id)
+{
+    auto found = region.find(id);
+    if (found == region.end()) {
+        return NO_VALUE;
+    }
+    return region_tree.subregion_count((*found).second.index);
+}
+
+void Datastructures::build_region_indexes()
+{
+    region_lca.build(region_tree.parents());
+    region_ancestors.build(region_tree.parents());
+    region_indexes_size = region_id_vec.size();
+    region_indexes_stale = false;
+    region_walk_steps = 0;
+}
+
+bool Datastructures::use_region_indexes()
+{
+    if (region_indexes_stale) {
+        // Building the tables costs about n*log(n)
+        std::size_t n = region_id_vec.size();
+        std::size_t rebuild_cost = n;
+        for (auto m = n; m > 1; m /= 2) {
+            rebuild_cost += n;
+        }
+        if (region_walk_steps >= rebuild_cost) {
+            build_region_indexes();
+        }
+    }
+    return !region_indexes_stale;
+}
+
+unsigned int Datastructures::walk_region_depth(RegionTree::Index v)
+{
+    unsigned int depth = 0;
+    for (auto u = region_tree.parent(v); u != RegionTree::NONE; u = region_tree.parent(u)) {
+        ++depth;
+    }
+    region_walk_steps += depth + 1;
+    return depth;
+}
+
+RegionTree::Index Datastructures::walk_common_ancestor(RegionTree::Index u, RegionTree::Index v)
+{
+    auto depth_u = walk_region_depth(u);
+    auto depth_v = walk_region_depth(v);
+    for (; depth_u > depth_v; --depth_u) {
+        u = region_tree.parent(u);
+    }
+    for (; depth_v > depth_u; --depth_v) {
+        v = region_tree.parent(v);
+    }
+    // Regions in different trees meet at NONE above their roots
+    while (u != v) {
+        u = region_tree.parent(u);
+        v = region_tree.parent(v);
+    }
+    return u;
+}
+
+void Datastructures::index_new_stations()
+{
+    if (unindexed_stations.empty()) {
+        return;
+    }
+
+    std::vector<StationHandle> by_coord(unindexed_stations);
+    auto sort_by_coord = [this, &by_coord](){
+        std::sort(by_coord.begin(), by_coord.end(), StationCoordLess{&station});
+    };
+    std::vector<std::thread> coord_sorter;
+    ThreadJoiner joiner(coord_sorter);
+    if (unindexed_stations.size() >= PARALLEL_INDEX_SORT_MIN) {
+        try {
+            coord_sorter.emplace_back(sort_by_coord);
+        } catch (std::system_error const&) {
+            sort_by_coord();
         }
-        parent2 = region.at(parent2).parentID;
+    } else {
+        sort_by_coord();
+    }
+
+    std::vector<StationHandle> scratch(unindexed_stations.size());
+    std::vector<unsigned short> chars(unindexed_stations.size());
+    sort_by_name(unindexed_stations.data(), unindexed_stations.data() + unindexed_stations.size(), station,
+                 scratch.data(), chars.data());
+    station_name_index.insert_sorted(unindexed_stations.begin(), unindexed_stations.end());
+
+    joiner.join();
+    station_coord_index.insert_sorted(by_coord.begin(), by_coord.end());
+    unindexed_stations.clear();
+}
+
+std::vector<StationID> Datastructures::station_names(const std::vector<StationHandle> &handles) const
+{
+    std::vector<StationID> result;
+    result.reserve(handles.size());
+    for (auto h : handles) {
+        result.push_back(station_ids.name(h));
+    }
+    return result;
+}
+
+bool Datastructures::departure_before(const Departure &a, const Departure &b) const
+{
+    if (a.time != b.time) {
+        return a.time < b.time;
     }
-    return NO_REGION;
+    // Same time: order by train id like station_departures_after promises
+    return a.train != b.train && train_ids.name(a.train) < train_ids.name(b.train);
 }
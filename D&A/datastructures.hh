@@ -20,7 +20,16 @@
 #include <map>
 #include <algorithm>
 #include <cmath>
+#include <cstdlib>
 #include <set>
+#include <new>
+#include <deque>
+#include <string_view>
+#include <iterator>
+#include <memory_resource>
+
+#include "flat_hash_map.hh"
+#include "btree.hh"
 
 // Types for IDs
 using StationID = std::string;
@@ -66,22 +75,51 @@ struct CoordHash
     }
 };
 
+// Precomputed sort key for coordinates: squared euclidean distance from
+// the origin, then y, then x. Fits 64 bits for any int coordinates, so
+// comparisons never overflow and don't have to multiply anything.
+struct CoordKey
+{
+    unsigned long long dist;
+    unsigned long long tie;  // y and x with their sign bits flipped, compares like (y, x)
+};
+
+inline CoordKey coord_key(Coord xy)
+{
+    auto x = static_cast<long long>(xy.x);
+    auto y = static_cast<long long>(xy.y);
+    auto flip = [](int v){ return static_cast<unsigned long long>(static_cast<unsigned int>(v) ^ 0x80000000u); };
+    return {static_cast<unsigned long long>(x*x) + static_cast<unsigned long long>(y*y),
+            (flip(xy.y) << 32) | flip(xy.x)};
+}
+
+inline bool operator<(CoordKey k1, CoordKey k2)
+{
+    return k1.dist < k2.dist || (k1.dist == k2.dist && k1.tie < k2.tie);
+}
+
+inline bool operator==(CoordKey k1, CoordKey k2) { return k1.dist == k2.dist && k1.tie == k2.tie; }
+
 // Example: Defining < for Coord so that it can be used
 // as key for std::map/set
 inline bool operator<(Coord c1, Coord c2)
 {
-    unsigned long long dis_a = c1.x*c1.x + c1.y*c1.y;
-    unsigned long long dis_b = c2.x*c2.x + c2.y*c2.y;
-
-    if ( dis_a == dis_b) {
-        return c1.y < c2.y;
-        }
-    return dis_a < dis_b;
+    return coord_key(c1) < coord_key(c2);
 }
 
 // Return value for cases where coordinates were not found
 Coord const NO_COORD = {NO_VALUE, NO_VALUE};
 
+// Squared euclidean distance, saturates instead of overflowing when both
+// coordinate differences are close to 2^32
+inline unsigned long long squared_distance(Coord c1, Coord c2)
+{
+    auto dx = static_cast<unsigned long long>(std::llabs(static_cast<long long>(c1.x) - c2.x));
+    auto dy = static_cast<unsigned long long>(std::llabs(static_cast<long long>(c1.y) - c2.y));
+    auto dist = dx*dx + dy*dy;
+    return dist < dx*dx ? std::numeric_limits<unsigned long long>::max() : dist;
+}
+
 // Type for a distance (in metres)
 using Distance = int;
 
@@ -108,92 +146,642 @@ private:
 // This is the class you are supposed to implement
 
 
-struct Station_Info {
-    Name name = NO_NAME;
-    Coord xy = NO_COORD;
-    RegionID regionParent = NO_REGION;
-    std::vector<std::pair<Time, TrainID>> schedule;
+// Dense 32-bit handles for id strings. A string gets the next free handle
+// the first time it is interned and keeps it until clear(), so handles can
+// index vectors and compare as plain integers.
+class SymbolTable
+{
+public:
+    using Handle = unsigned int;
+    static constexpr Handle NONE = std::numeric_limits<Handle>::max();
+
+    Handle intern(std::string_view s);
+    // Handle of s, or NONE if s has not been interned
+    Handle find(std::string_view s) const;
+    // Forgets the string of h, intern may give h to another string later
+    void release(Handle h);
+    std::string const& name(Handle h) const { return names_[h]; }
+    // One past the largest handle given out
+    std::size_t size() const { return names_.size(); }
+    void clear();
+
+private:
+    std::deque<std::string> names_;  // deque keeps the strings viewed by handles_ in place
+    FlatHashMap<std::string_view, Handle> handles_;
+    std::vector<Handle> free_;  // released handles
+};
+
+using StationHandle = SymbolTable::Handle;
+using TrainHandle = SymbolTable::Handle;
+
+struct Departure
+{
+    Time time;
+    TrainHandle train;
+};
+
+// Station data as parallel columns indexed by StationHandle. Operations
+// that need one attribute only read that column: the name column for
+// sorting, the coordinate column for the indexes, the region column for
+// region walks. Handles of removed stations go back to the symbol table's
+// free list and get reused, so the columns stay dense.
+struct StationColumns
+{
+    explicit StationColumns(std::pmr::memory_resource* resource)
+        : names(resource), xys(resource), xy_keys(resource), region_parents(resource),
+          schedules(resource), coord_slots(resource), in_use(resource) {}
+
+    std::pmr::vector<std::pmr::string> names;
+    std::pmr::vector<Coord> xys;
+    std::pmr::vector<CoordKey> xy_keys;
+    std::pmr::vector<RegionID> region_parents;
+    std::pmr::vector<std::pmr::vector<Departure>> schedules;  // each sorted by time, then train id
+    std::pmr::vector<unsigned int> coord_slots;  // positions in Datastructures::station_coords
+    std::pmr::vector<unsigned char> in_use;  // 0 for free slots
+
+    std::size_t size() const { return in_use.size(); }
+    // Marks slot used, growing the columns to it if needed
+    void open(StationHandle slot);
+    // Resets slot to the values of a free slot
+    void close(StationHandle slot);
+    // Empties the columns and gives their storage back
+    void clear();
 };
 
+// Region_Info is allocator aware, so that the name and the vectors of an
+// info stored in a pmr container are allocated from the same memory
+// resource as the container. Copies and moves made with an allocator copy
+// or move member by member into storage from that allocator.
 struct Region_Info {
-    Name name = NO_NAME;
-    std::vector<Coord> xy_vec;
+    using allocator_type = std::pmr::polymorphic_allocator<std::byte>;
+
+    Region_Info() = default;
+    explicit Region_Info(allocator_type alloc) : name(NO_NAME, alloc), xy_vec(alloc) {}
+    Region_Info(Region_Info const& other, allocator_type alloc) : Region_Info(alloc) { *this = other; }
+    Region_Info(Region_Info&& other, allocator_type alloc) : Region_Info(alloc) { *this = std::move(other); }
+    Region_Info(Region_Info const&) = default;
+    Region_Info(Region_Info&&) = default;
+    Region_Info& operator=(Region_Info const&) = default;
+    Region_Info& operator=(Region_Info&&) = default;
+
+    std::pmr::string name{NO_NAME};
+    std::pmr::vector<Coord> xy_vec;
     RegionID parentID = NO_REGION;
-    std::vector<RegionID> childrendID;
+    std::size_t index = 0;  // position in Datastructures::region_id_vec
 };
 
-using Station = std::unordered_map<StationID, Station_Info>;
+// Keeps the k stations closest to a query point seen so far during a
+// nearest station search. Stations at the same distance are ordered by
+// their CoordKey, then by id.
+class NearestHeap
+{
+public:
+    NearestHeap(std::size_t k, unsigned long long max_dist, SymbolTable const& ids)
+        : k_(k), max_dist_(max_dist), ids_(&ids) {}
+
+    void offer(unsigned long long dist, CoordKey key, StationHandle id);
+    std::size_t k() const { return k_; }
 
-using Region = std::unordered_map<RegionID, Region_Info>;
+    // Largest squared distance a station can still have to get in
+    unsigned long long bound() const { return heap_.size() < k_ ? max_dist_ : heap_.front().dist; }
+
+    // Empties the heap, closest station first
+    std::vector<StationHandle> take();
+
+private:
+    struct Candidate
+    {
+        unsigned long long dist;
+        CoordKey key;
+        StationHandle id;
+    };
+    bool closer(Candidate const& a, Candidate const& b) const;
+
+    std::size_t k_;
+    unsigned long long max_dist_;
+    SymbolTable const* ids_;
+    std::vector<Candidate> heap_;
+};
+
+// 2-d tree over the station coordinates, used for nearest station queries.
+// New stations are inserted like in a plain binary search tree and the
+// highest subtree that got too deep is rebuilt around its median (scapegoat
+// style). Removed stations are only marked and the whole tree is rebuilt
+// once half of its nodes are removed ones.
+class KdTree
+{
+public:
+    void insert(Coord xy, StationHandle id);
+    bool erase(Coord xy, StationHandle id);
+    void clear();
+    std::size_t size() const { return live_; }
+
+    // Some station at exactly xy, or SymbolTable::NONE
+    StationHandle find(Coord xy) const;
+
+    // Offers heap the stations that can be among its k closest to xy
+    void nearest(Coord xy, NearestHeap& heap) const;
+
+private:
+    struct Node
+    {
+        Coord xy;
+        CoordKey key;
+        StationHandle id;
+        int left = -1;
+        int right = -1;
+        unsigned int size = 1;   // nodes in this subtree, removed ones included
+        unsigned char axis = 0;  // 0 splits on x, 1 splits on y
+        bool removed = false;
+    };
+
+    std::vector<Node> nodes_;
+    int root_ = -1;
+    std::size_t live_ = 0;
+
+    static int split_key(Coord xy, unsigned char axis) { return axis == 0 ? xy.x : xy.y; }
+    int build(std::vector<int>& idx, std::size_t begin, std::size_t end, unsigned char axis);
+    void collect(int node, std::vector<int>& idx) const;
+    int find(int node, Coord xy, StationHandle id) const;
+    void rebuild_all();
+    void nearest(int node, Coord xy, NearestHeap& heap) const;
+};
+
+// Uniform grid over the station coordinates: stations are bucketed by
+// the square cell they are in. Exact coordinate lookups only look at one
+// bucket, nearest station searches look at rings of cells around the
+// query point until no closer station can exist. The cell size is picked
+// from the bounding box so that a cell has about two stations, and the
+// grid is rebuilt whenever the station count doubles or drops to a quarter.
+// Same interface as KdTree, so that either one can be the StationIndex.
+class GridIndex
+{
+public:
+    void insert(Coord xy, StationHandle id);
+    bool erase(Coord xy, StationHandle id);
+    void clear();
+    std::size_t size() const { return size_; }
+
+    StationHandle find(Coord xy) const;
+    void nearest(Coord xy, NearestHeap& heap) const;
+
+private:
+    struct Entry
+    {
+        Coord xy;
+        CoordKey key;
+        StationHandle id;
+    };
+    using Cell = std::vector<Entry>;
+
+    std::unordered_map<Coord, Cell, CoordHash> cells_;
+    std::size_t size_ = 0;
+    std::size_t regrid_size_ = 0;  // station count at the last rebuild
+    int cell_shift_ = 0;           // cells are 2^cell_shift_ wide
+    // Bounding box of the cells that have had stations since the last rebuild
+    Coord min_cell_ = {std::numeric_limits<int>::max(), std::numeric_limits<int>::max()};
+    Coord max_cell_ = {std::numeric_limits<int>::min(), std::numeric_limits<int>::min()};
+
+    Coord cell_of(Coord xy) const { return {xy.x >> cell_shift_, xy.y >> cell_shift_}; }
+    long long cell_size() const { return 1LL << cell_shift_; }
+    void regrid();
+};
+
+// Morton (Z-order) code of a coordinate: the bits of x and y interleaved,
+// with the sign bits flipped so that codes compare like the coordinates
+inline unsigned long long morton_code(Coord xy)
+{
+    auto spread = [](unsigned long long v) {
+        v = (v | (v << 16)) & 0x0000FFFF0000FFFFULL;
+        v = (v | (v << 8)) & 0x00FF00FF00FF00FFULL;
+        v = (v | (v << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+        v = (v | (v << 2)) & 0x3333333333333333ULL;
+        v = (v | (v << 1)) & 0x5555555555555555ULL;
+        return v;
+    };
+    return spread(static_cast<unsigned int>(xy.x) ^ 0x80000000u) |
+           (spread(static_cast<unsigned int>(xy.y) ^ 0x80000000u) << 1);
+}
+
+// Stations in a few arrays sorted by the Morton code of their
+// coordinates, so that a rectangle query reads contiguous runs of memory
+// instead of following tree nodes. New stations go to a small unsorted
+// buffer; a full buffer is sorted into a run, and runs are merged like
+// the digits of a binary counter, so there are O(log n) runs and every
+// station is merged O(log n) times. Removed stations are marked and
+// compacted away once a quarter of them is removed.
+class MortonIndex
+{
+public:
+    void insert(Coord xy, StationHandle id);
+    bool erase(Coord xy, StationHandle id);
+    void clear();
+    std::size_t size() const { return stored_ - removed_ + pending_.size(); }
+
+    // Calls visit for every station with min.x <= x <= max.x and
+    // min.y <= y <= max.y, in Morton order within each run (buffered
+    // stations last).
+    void visit_rect(Coord min, Coord max, std::function<void(StationHandle, Coord)> const& visit) const;
+
+private:
+    struct Entry
+    {
+        unsigned long long code;
+        Coord xy;
+        StationHandle id;
+        bool removed = false;
+    };
+    using Run = std::vector<Entry>;
+
+    std::vector<Run> runs_;  // sorted by code each, largest first, each at most half the one before
+    std::vector<Entry> pending_;
+    std::size_t stored_ = 0;  // entries in runs_, removed ones included
+    std::size_t removed_ = 0;
+
+    static bool by_code(Entry const& a, Entry const& b) { return a.code < b.code; }
+    void flush_pending();
+    void compact();
+};
+
+// std::allocator replacement that aligns the storage to Align bytes, for
+// arrays read with aligned SIMD loads
+template <typename T, std::size_t Align>
+struct AlignedAllocator
+{
+    using value_type = T;
+    template <typename U> struct rebind { using other = AlignedAllocator<U, Align>; };
+
+    AlignedAllocator() = default;
+    template <typename U> AlignedAllocator(AlignedAllocator<U, Align> const&) {}
+
+    T* allocate(std::size_t n)
+    {
+        return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(Align)));
+    }
+    void deallocate(T* p, std::size_t) { ::operator delete(p, std::align_val_t(Align)); }
+
+    bool operator==(AlignedAllocator const&) const { return true; }
+    bool operator!=(AlignedAllocator const&) const { return false; }
+};
+
+// Station coordinates as two packed int32 columns (structure of arrays),
+// for brute-force nearest station searches that compute eight distances
+// per instruction with AVX2 (four with SSE4.1, one without either).
+// Removal moves the last station into the freed slot.
+class CoordColumns
+{
+public:
+    // Adds a station and returns its slot
+    unsigned int push(Coord xy, StationHandle id);
+    void set(unsigned int slot, Coord xy);
+    // Removes the station in slot. Returns the station that was moved into
+    // slot, or SymbolTable::NONE if slot was the last one.
+    StationHandle erase(unsigned int slot);
+    void clear();
+    std::size_t size() const { return ids_.size(); }
+
+    void nearest(Coord xy, NearestHeap& heap) const;
+
+private:
+    // Coordinates up to this size keep differences and their squares in
+    // the ranges the SIMD kernel computes in
+    static int const SIMD_LIMIT = (1 << 30) - 1;
+
+    std::vector<int, AlignedAllocator<int, 32>> xs_;
+    std::vector<int, AlignedAllocator<int, 32>> ys_;
+    std::vector<StationHandle> ids_;
+    bool simd_ok_ = true;  // no coordinate outside +-SIMD_LIMIT since the last clear
+
+    void offer_range(Coord xy, std::size_t begin, std::size_t end, NearestHeap& heap) const;
+};
+
+// Compile with -DUSE_GRID_INDEX to index station coordinates with the grid
+#ifdef USE_GRID_INDEX
+using StationIndex = GridIndex;
+#else
+using StationIndex = KdTree;
+#endif
+
+// Lowest common ancestors in a forest whose nodes are numbered 0..n-1.
+// An Euler tour lists every node each time the walk through its tree
+// passes it; the lowest common ancestor of two nodes is the shallowest
+// node the tour passes between their first visits. A sparse table holds
+// the shallowest node of every tour range of length 2^j, so two
+// overlapping table entries answer a query.
+class EulerTourLca
+{
+public:
+    using Node = unsigned int;
+    static constexpr Node NONE = std::numeric_limits<Node>::max();
+
+    // parents[v] is the parent of node v, or NONE if v is a root
+    void build(std::vector<Node> const& parents);
+    // NONE if u and v are in different trees
+    Node lca(Node u, Node v) const;
+    void clear();
+
+private:
+    std::vector<Node> first_child_;  // children of v are child_list_[first_child_[v] .. first_child_[v+1])
+    std::vector<Node> child_list_;
+    std::vector<Node> depth_;
+    std::vector<Node> root_;
+    std::vector<Node> first_visit_;  // position of v in tour_
+    std::vector<Node> tour_;
+    std::vector<Node> table_;        // level j at j*tour_.size(), entry i is the shallowest of tour_[i .. i+2^j)
+
+    Node shallower(Node u, Node v) const { return depth_[u] <= depth_[v] ? u : v; }
+};
+
+// Ancestors in a forest whose nodes are numbered 0..n-1, by binary
+// lifting: level j holds the 2^j-th ancestor of every node, so the k-th
+// ancestor is reached in one jump per set bit of k.
+class AncestorTable
+{
+public:
+    using Node = unsigned int;
+    static constexpr Node NONE = std::numeric_limits<Node>::max();
+
+    // parents[v] is the parent of node v, or NONE if v is a root
+    void build(std::vector<Node> const& parents);
+    // NONE if v has fewer than k ancestors
+    Node kth_ancestor(Node v, Node k) const;
+    Node depth(Node v) const { return depth_[v]; }
+    void clear();
+
+private:
+    std::size_t n_ = 0;
+    std::vector<Node> depth_;
+    std::vector<Node> jumps_;  // level j at j*n_, entry v is the 2^j-th ancestor of v or NONE
+};
+
+// Region hierarchy kept as one pre-order array of the whole forest, so
+// that every subtree is a contiguous run: region v and its subregions
+// are at [position(v), position(v) + size(v)). Listing the subregions is
+// a copy of that run and containment is two comparisons. Attaching a
+// top level region moves its run to the end of the new parent's run and
+// renumbers the regions in between. When too many regions are in
+// between, or above the new parent, the array goes stale instead. A stale
+// array is not used: queries walk the child lists or the parents, and
+// the array is laid out again once those walks have passed as many
+// regions as there are. Station counts are kept in a Fenwick tree over
+// the pre-order positions, so that the stations in a region and its
+// subregions are a sum over its run, and adding a station costs O(log n)
+// however deep its region is.
+class RegionTree
+{
+public:
+    using Index = unsigned int;
+    static constexpr Index NONE = std::numeric_limits<Index>::max();
+
+    // Adds id as a top level region, its index is the old size()
+    Index add(RegionID id);
+    // Makes the top level region child a subregion of parent
+    void attach(Index child, Index parent);
+    // Counts delta more stations directly in region v
+    void add_stations(Index v, int delta);
+    void clear();
+
+    std::size_t size() const { return parent_.size(); }
+    // NONE for a top level region
+    Index parent(Index v) const { return parent_[v]; }
+    std::vector<Index> const& parents() const { return parent_; }
+    // Subregions of v, directly or indirectly, in pre-order
+    std::vector<RegionID> subregions(Index v);
+    // A region does not contain itself
+    bool contains(Index outer, Index inner);
+    Index subregion_count(Index v);
+    // Stations in v and its subregions
+    Index station_count(Index v);
+
+private:
+    std::vector<Index> parent_;        // by index
+    std::vector<Index> first_child_;   // by index, children in the order they were attached
+    std::vector<Index> last_child_;    // by index
+    std::vector<Index> next_sibling_;  // by index
+    std::vector<Index> position_;      // by index, place in order_
+    std::vector<Index> size_;          // by index, regions in the subtree including itself
+    std::vector<Index> direct_stations_;  // by index, stations added to the region itself
+    std::vector<int> station_sums_;    // Fenwick tree of direct_stations_ by position, entry i-1 sums positions [i - lowbit(i), i)
+    std::vector<Index> order_;         // indexes in pre-order
+    std::vector<RegionID> ids_;        // ids in pre-order
+    bool stale_ = false;               // everything but the links and direct_stations_ waits for update()
+    std::size_t walk_steps_ = 0;       // regions passed by walks since the array went stale
+
+    // Adds the subtree size of v to its ancestors, or leaves a long chain
+    // of them to update()
+    void add_to_ancestors(Index v, Index size);
+    // Stations directly in the regions at positions [0, position)
+    int stations_before(Index position) const;
+    void add_stations_at(Index position, int delta);
+    // false while the array is stale, lays it out again first if the
+    // walks have paid for that
+    bool use_order();
+    void update();
+    // Calls visit for v and every region under it in pre-order, adding
+    // them to walk_steps_
+    template <typename Visit>
+    void walk_subtree(Index v, Visit visit);
+};
+
+// Non-owning view of consecutive departures in a station schedule. Reads
+// the departures as (time, train id) pairs, the train ids are looked up
+// from the train symbol table. Stays valid until a departure is added to
+// or removed from that station, or the station is removed.
+class DepartureRange
+{
+public:
+    using value_type = std::pair<Time, TrainID>;
+    using reference = std::pair<Time, TrainID const&>;
+
+    class const_iterator
+    {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = DepartureRange::value_type;
+        using reference = DepartureRange::reference;
+        using pointer = void;
+        using difference_type = std::ptrdiff_t;
+
+        const_iterator(Departure const* at, SymbolTable const* trains) : at_(at), trains_(trains) {}
+
+        reference operator*() const { return {(*at_).time, train_name(trains_, (*at_).train)}; }
+        const_iterator& operator++() { ++at_; return *this; }
+        const_iterator operator++(int) { auto old = *this; ++at_; return old; }
+        bool operator==(const_iterator const& other) const { return at_ == other.at_; }
+        bool operator!=(const_iterator const& other) const { return at_ != other.at_; }
+
+    private:
+        Departure const* at_;
+        SymbolTable const* trains_;
+    };
+
+    DepartureRange(Departure const* first, Departure const* last, SymbolTable const* trains)
+        : first_(first), last_(last), trains_(trains) {}
+
+    const_iterator begin() const { return {first_, trains_}; }
+    const_iterator end() const { return {last_, trains_}; }
+    std::size_t size() const { return last_ - first_; }
+    bool empty() const { return first_ == last_; }
+    reference operator[](std::size_t i) const { return {first_[i].time, train_name(trains_, first_[i].train)}; }
+
+private:
+    Departure const* first_;
+    Departure const* last_;
+    SymbolTable const* trains_;
+
+    // SymbolTable::NONE stands for NO_TRAIN
+    static TrainID const& train_name(SymbolTable const* trains, TrainHandle train)
+    {
+        return train == SymbolTable::NONE ? NO_TRAIN : (*trains).name(train);
+    }
+};
+
+// Orderings of the sorted station indexes. The indexes hold only station
+// handles and read the names and coordinate keys from the station
+// columns, so a station has to be erased from an index before its column
+// values change. Stations with the same name or the same coordinates are
+// told apart by their handle, so none of them overwrites another.
+struct StationNameLess
+{
+    StationColumns const* columns;
+
+    bool operator()(StationHandle h1, StationHandle h2) const
+    {
+        int order = std::string_view((*columns).names[h1]).compare(std::string_view((*columns).names[h2]));
+        return order < 0 || (order == 0 && h1 < h2);
+    }
+};
+
+struct StationCoordLess
+{
+    StationColumns const* columns;
+
+    bool operator()(StationHandle h1, StationHandle h2) const
+    {
+        CoordKey const& k1 = (*columns).xy_keys[h1];
+        CoordKey const& k2 = (*columns).xy_keys[h2];
+        return k1 < k2 || (k1 == k2 && h1 < h2);
+    }
+};
+
+// Read-only view of a sorted station list cached inside Datastructures.
+// The view stays readable until the list is asked for again after a
+// mutation; valid() tells whether the ordering it shows is still current.
+class StationListView
+{
+public:
+    using const_iterator = std::vector<StationID>::const_iterator;
+
+    StationListView(std::vector<StationID> const& ids, std::size_t version, std::size_t const* current)
+        : ids_(&ids), version_(version), current_(current) {}
+
+    const_iterator begin() const { return (*ids_).begin(); }
+    const_iterator end() const { return (*ids_).end(); }
+    std::size_t size() const { return (*ids_).size(); }
+    bool empty() const { return (*ids_).empty(); }
+    StationID const& operator[](std::size_t i) const { return (*ids_)[i]; }
+    std::vector<StationID> const& ids() const { return *ids_; }
+
+    // Version of the station data the list was built from
+    std::size_t version() const { return version_; }
+    // False once a mutation has changed the ordering
+    bool valid() const { return version_ == *current_; }
+
+private:
+    std::vector<StationID> const* ids_;
+    std::size_t version_;
+    std::size_t const* current_;
+};
+
+using Station = StationColumns;
+
+using Region = FlatHashMap<RegionID, Region_Info, std::hash<RegionID>, std::equal_to<RegionID>,
+                           std::pmr::polymorphic_allocator<std::pair<RegionID, Region_Info>>>;
 
 
 
 class Datastructures
 {
 public:
-    Datastructures();
+    // Names, schedules, region data and the ordered indexes are allocated
+    // from an arena that takes its memory from upstream in large chunks
+    explicit Datastructures(std::pmr::memory_resource* upstream = std::pmr::get_default_resource());
     ~Datastructures();
 
     // Estimate of performance: O(1)
     // Short rationale for estimate:
-    // return size of unordermap station
+    // return counter of stations in use
     unsigned int station_count();
 
-    // Estimate of performance: O(1)
+    // Estimate of performance: O(n)
     // Short rationale for estimate:
-    // Clear all data inside unordermap station, unordermap region, map station_coord_map
+    // destructors still run, but arena memory is not freed object by object, the arena is released in one go
     void clear_all();
 
     // Estimate of performance: O(n)
-    // Short rationale for estimate: loop through n element of unordermap staion to get StationID
+    // Short rationale for estimate: loop through station handles, names from the symbol table
     std::vector<StationID> all_stations();
 
     // Estimate of performance: O(log(n))
-    // Short rationale for estimate: find & insert in unordermap cost constant, same with assign, but insert in map cost log(n)
-    bool add_station(StationID id, Name const& name, Coord xy);
+    // Short rationale for estimate: probe & intern in the symbol table's open-addressing map cost constant, the station columns are written at the new handle, insert in the kd-tree cost log(n), the Morton runs log(n) amortized; the sorted indexes take the station later in one batch
+    bool add_station(std::string_view id, Name const& name, Coord xy);
 
     // Estimate of performance: O(1)
-    // Short rationale for estimate: find & access unordermap station id cost constant
-    Name get_station_name(StationID id);
+    // Short rationale for estimate: open-addressing probe from id to handle, then one read of the name column
+    Name get_station_name(std::string_view id);
 
     // Estimate of performance: O(1)
-    // Short rationale for estimate: find & access unordermap station id cost constant
-    Coord get_station_coordinates(StationID id);
+    // Short rationale for estimate: open-addressing probe from id to handle, then one read of the coordinate column
+    Coord get_station_coordinates(std::string_view id);
 
     // We recommend you implement the operations below only after implementing the ones above
 
     // Estimate of performance: O(n)
-    // Short rationale for estimate: loop through n element twice
+    // Short rationale for estimate: copy of the cached list, which is one walk of the name index when out of date
     std::vector<StationID> stations_alphabetically();
 
-    // Estimate of performance: O(n) 
-    // Short rationale for estimate: loop through n element once
+    // Estimate of performance: O(n)
+    // Short rationale for estimate: copy of the cached list, which is one walk of the coordinate index when out of date
     std::vector<StationID> stations_distance_increasing();
 
-    // Estimate of performance: O(log(n))
-    // Short rationale for estimate: find & access element in map cost log(n)
+    // Estimate of performance: O(1), O(n) after a mutation
+    // Short rationale for estimate: hands out the cached list, rebuilt from the name index when its version is old
+    StationListView stations_alphabetically_view();
+
+    // Estimate of performance: O(1), O(n) after a mutation
+    // Short rationale for estimate: hands out the cached list, rebuilt from the coordinate index when its version is old
+    StationListView stations_distance_increasing_view();
+
+    // Estimate of performance: O(log(n)), O(1) with USE_GRID_INDEX
+    // Short rationale for estimate: k-d tree descent / one grid bucket lookup
     StationID find_station_with_coord(Coord xy);
 
-    // Estimate of performance: O(log(n))
-    // Short rationale for estimate: the most affective one here is map erase
-    bool change_station_coord(StationID id, Coord newcoord);
+    // Estimate of performance: O(log(n)^2)
+    // Short rationale for estimate: the most affective one here is the Morton erase, a binary search in each of log(n) runs
+    bool change_station_coord(std::string_view id, Coord newcoord);
 
-    // Estimate of performance: O(log(n))
-    // Short rationale for estimate: find & push back cost constant
-    bool add_departure(StationID stationid, TrainID trainid, Time time);
+    // Estimate of performance: O(d), d = departures from the station
+    // Short rationale for estimate: lower_bound in sorted schedule is log(d), insert shifts the rest
+    bool add_departure(std::string_view stationid, std::string_view trainid, Time time);
 
-    // Estimate of performance: O(log(n))
-    // Short rationale for estimate: find & erase in map cost log(n)
-    bool remove_departure(StationID stationid, TrainID trainid, Time time);
+    // Estimate of performance: O(d), d = departures from the station
+    // Short rationale for estimate: lower_bound in sorted schedule is log(d), erase shifts the rest
+    bool remove_departure(std::string_view stationid, std::string_view trainid, Time time);
 
-    // Estimate of performance: O(n)
-    // Short rationale for estimate: copy_if cost O(n)
-    std::vector<std::pair<Time, TrainID>> station_departures_after(StationID stationid, Time time);
+    // Estimate of performance: O(log(d) + m), m = departures returned
+    // Short rationale for estimate: lower_bound in sorted schedule, then copy of at most limit departures
+    std::vector<std::pair<Time, TrainID>> station_departures_after(std::string_view stationid, Time time,
+                                                                   std::size_t limit = std::numeric_limits<std::size_t>::max());
+
+    // Estimate of performance: O(log(d))
+    // Short rationale for estimate: lower_bound in sorted schedule, nothing is copied
+    DepartureRange station_departures_after_view(std::string_view stationid, Time time,
+                                                 std::size_t limit = std::numeric_limits<std::size_t>::max());
 
     // We recommend you implement the operations below only after implementing the ones above
 
     // Estimate of performance: O(1)
-    // Short rationale for estimate: find & assign in unordermap & vector is constant
+    // Short rationale for estimate: probe & insert in the open-addressing region map cost constant, pushes to the id vector and region tree amortized constant
     bool add_region(RegionID id, Name const &name, std::vector<Coord> coords);
 
     // Estimate of performance: O(1)
@@ -201,61 +789,138 @@ public:
     std::vector<RegionID> all_regions();
 
     // Estimate of performance: O(1)
-    // Short rationale for estimate: find in unordermap cost constant 
+    // Short rationale for estimate: probe in the open-addressing region map cost constant
     Name get_region_name(RegionID id);
 
     // Estimate of performance: O(1)
-    // Short rationale for estimate: find & assign in unordermap cost constant
+    // Short rationale for estimate: probe in the open-addressing region map cost constant, then a copy of the region's few coordinates
     std::vector<Coord> get_region_coords(RegionID id);
 
-    // Estimate of performance: O(1)
-    // Short rationale for estimate: find in unordermap cost constant
+    // Estimate of performance: O(m + d), m = regions between the subregion and its new place, d = depth of parentid, both capped
+    // Short rationale for estimate: the pre-order array moves the subregion's run next to parentid's and parent sizes grow up to the top; past a fixed limit the array goes stale, and queries walk the tree until the walks pay for laying it out again in O(n)
     bool add_subregion_to_region(RegionID id, RegionID parentid);
 
-    // Estimate of performance: O(1)
-    // Short rationale for estimate: find & access in unordermap cost constant
-    bool add_station_to_region(StationID id, RegionID parentid);
+    // Estimate of performance: O(log(n))
+    // Short rationale for estimate: open-addressing probes for the station handle and the region cost constant, the region column is written at the handle, the region's station count is a Fenwick tree update
+    bool add_station_to_region(std::string_view id, RegionID parentid);
 
-    // Estimate of performance: O(n)
-    // Short rationale for estimate: depend on recursive
-    std::vector<RegionID> station_in_regions(StationID id);
+    // Estimate of performance: O(d), d = depth of the station's region
+    // Short rationale for estimate: one hash lookup, then one read of the dense parent array per level
+    std::vector<RegionID> station_in_regions(std::string_view id);
 
     // Non-compulsory operations
 
-    // Estimate of performance: O(n)
-    // Short rationale for estimate: it denpend on recursive times 
+    // Estimate of performance: O(m), m = number of subregions
+    // Short rationale for estimate: copies the region's run of the pre-order array, or walks the child lists while it is stale
     std::vector<RegionID> all_subregions_of_region(RegionID id);
 
-    // Estimate of performance: O(n)
-    // Short rationale for estimate: loop through map once
-    std::vector<StationID> stations_closest_to(Coord xy);
+    // Estimate of performance: O(k*log(n)) on average
+    // Short rationale for estimate: k-d tree search only visits the cells around xy, heap of k costs log(k)
+    std::vector<StationID> stations_closest_to(Coord xy, std::size_t k = 3);
 
-    // Estimate of performance: O(log(n))
-    // Short rationale for estimate: erase map cost log(n)
-    bool remove_station(StationID id);
+    // Estimate of performance: O(q*log(q) + q*k*log(n)/t), q = number of points, t = threads
+    // Short rationale for estimate: points sorted by Morton code, then searched in parallel chunks
+    std::vector<std::vector<StationID>> stations_closest_to_batch(std::vector<Coord> const& points, std::size_t k = 3);
 
     // Estimate of performance: O(n)
-    // Short rationale for estimate: depend on recusive times 
+    // Short rationale for estimate: computes every distance, 8 at a time with AVX2.
+    // Slow but index free, a reference to check stations_closest_to against
+    std::vector<StationID> stations_closest_to_bruteforce(Coord xy, std::size_t k = 3);
+
+    // Estimate of performance: O(log(n) + m*log(m)), m = stations inside the radius
+    // Short rationale for estimate: k-d tree search prunes cells outside the radius
+    std::vector<StationID> stations_within_radius(Coord xy, Distance radius,
+                                                  std::size_t k = std::numeric_limits<std::size_t>::max());
+
+    // Estimate of performance: O(log(n)*j*log(n) + m), j = times the Z curve leaves the rectangle, m = stations inside it
+    // Short rationale for estimate: Morton order scan of each of the log(n) sorted runs jumps over codes outside the rectangle
+    std::vector<StationID> stations_in_rect(Coord min, Coord max);
+
+    // Estimate of performance: O(log(n)*j*log(n) + m), same as stations_in_rect
+    // Short rationale for estimate: same search as stations_in_rect without building a vector
+    void for_each_station_in_rect(Coord min, Coord max, std::function<void(StationID const&, Coord)> const& visit);
+
+    // Estimate of performance: O(log(n)^2)
+    // Short rationale for estimate: erase map cost log(n), Morton erase a binary search in each of log(n) runs, region station count a Fenwick tree update
+    bool remove_station(std::string_view id);
+
+    // Estimate of performance: O(1), amortized O(d) after add_subregion_to_region, d = depth of the regions
+    // Short rationale for estimate: two sparse table reads; stale tables are not used, the parents are walked until the walks pay for an O(n*log(n)) rebuild
     RegionID common_parent_of_regions(RegionID id1, RegionID id2);
 
-private:
-    Station station;
-    std::map<Coord, StationID> station_coord_map;
-    std::map<Name, StationID> station_name_map;
+    // Estimate of performance: O(log(d)), amortized O(min(k, d)) after add_subregion_to_region
+    // Short rationale for estimate: one ancestor table jump per bit of k, or a parent walk like in common_parent_of_regions
+    RegionID region_ancestor(RegionID id, unsigned int k);
 
-    Region region;
-    std::vector<RegionID> region_id_vec;
+    // Estimate of performance: O(1), amortized O(d) after add_subregion_to_region
+    // Short rationale for estimate: depth is stored by the ancestor table, or a parent walk like in common_parent_of_regions
+    int region_depth(RegionID id);
+
+    // Estimate of performance: O(1), amortized O(d) while the pre-order array is stale, d = depth of id
+    // Short rationale for estimate: two comparisons of pre-order positions, or a walk up from id
+    bool is_region_ancestor(RegionID ancestor, RegionID id);
 
-    void recursive_add_subregion(std::vector<RegionID> &subregion_Id, std::vector<RegionID>&r);
-    void recursive_add_parent_region(RegionID &parent_Id, std::vector<RegionID>&r);
+    // Estimate of performance: O(log(n)), amortized O(m) while the pre-order array is stale, m = number of subregions
+    // Short rationale for estimate: two Fenwick tree prefix sums over the region's run in the pre-order array, or a walk over the subregions
+    int count_stations_in_region(RegionID id);
 
-    bool cache_station_distance_increasing = false;
-    bool cache_station_alphabeltically = false;
+    // Estimate of performance: O(1), amortized O(m) while the pre-order array is stale, m = number of subregions
+    // Short rationale for estimate: the size of the region's run in the pre-order array, minus the region itself, or a walk over the subregions
+    int count_subregions_of_region(RegionID id);
 
-    std::vector<StationID> result_distance_increasing;
-    std::vector<StationID> result_alphabeltically;
-    void find_all_parent_region(RegionID id, std::unordered_set<RegionID> &r);
+private:
+    // Declared first so that it outlives everything allocated from it
+    std::pmr::monotonic_buffer_resource arena;
+
+    SymbolTable station_ids;
+    SymbolTable train_ids;
 
+    Station station;
+    std::size_t station_total = 0;
+    BTreeSet<StationHandle, StationCoordLess> station_coord_index;
+    BTreeSet<StationHandle, StationNameLess> station_name_index;
+    // Added stations that are not in the two indexes yet. They are sorted
+    // and merged in together when an index is next needed, so that bulk
+    // loads do not pay for a tree insert per station.
+    std::vector<StationHandle> unindexed_stations;
+
+    // Bumped whenever the alphabetical / distance ordering changes. The
+    // cached lists are up to date when their version equals these.
+    std::size_t name_order_version = 0;
+    std::size_t coord_order_version = 0;
+    std::vector<StationID> alphabetical_list;
+    std::size_t alphabetical_list_version = std::numeric_limits<std::size_t>::max();
+    std::vector<StationID> distance_list;
+    std::size_t distance_list_version = std::numeric_limits<std::size_t>::max();
+    StationIndex station_index;
+    MortonIndex station_morton;
+    CoordColumns station_coords;
+
+    Region region;
+    std::pmr::vector<RegionID> region_id_vec;
+    // Regions by their position in region_id_vec
+    RegionTree region_tree;
+    // Ancestry of the regions by their position in region_id_vec. The
+    // first region_indexes_size regions are in the indexes, the ones added
+    // after them are top level regions without subregions until a
+    // subregion is added and the indexes go stale. Stale indexes are not
+    // used; queries walk the parent array instead, and the indexes are
+    // rebuilt once those walks have cost about as much as a rebuild.
+    EulerTourLca region_lca;
+    AncestorTable region_ancestors;
+    std::size_t region_indexes_size = 0;
+    bool region_indexes_stale = true;
+    std::size_t region_walk_steps = 0;  // regions passed by parent walks since the indexes went stale
+
+
+    void build_region_indexes();
+    bool use_region_indexes();
+    unsigned int walk_region_depth(RegionTree::Index v);
+    RegionTree::Index walk_common_ancestor(RegionTree::Index u, RegionTree::Index v);
+
+    void index_new_stations();
+    std::vector<StationID> station_names(std::vector<StationHandle> const& handles) const;
+    bool departure_before(Departure const& a, Departure const& b) const;
 };
 
 #endif // DATASTRUCTURES_HH
@@ -0,0 +1,325 @@
+// flat_hash_map.hh
+//
+// Open-addressing hash map in the style of Swiss tables, used instead of
+// std::unordered_map for the id lookup tables in Datastructures.
+
+#ifndef FLAT_HASH_MAP_HH
+#define FLAT_HASH_MAP_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+// Hash map that keeps its entries in one array instead of separate nodes.
+// Every slot has a control byte: 7 bits of the key's hash when the slot is
+// in use, or a marker for empty and erased slots. The control bytes are
+// read eight at a time as one 64-bit word, so a lookup compares a whole
+// group of slots with a few integer operations and usually touches only
+// the one slot whose key matches.
+//
+// Keys and values have to be default constructible, unused slots hold
+// default constructed entries. Inserting may move every entry, which
+// invalidates iterators and references; erasing does not. Both arrays are
+// allocated with Allocator (rebound to the control bytes for those).
+template <typename Key, typename Value, typename Hash = std::hash<Key>, typename Equal = std::equal_to<Key>,
+          typename Allocator = std::allocator<std::pair<Key, Value>>>
+class FlatHashMap
+{
+public:
+    using value_type = std::pair<Key, Value>;
+    using allocator_type = Allocator;
+
+    FlatHashMap() = default;
+    explicit FlatHashMap(Allocator const& alloc) : ctrl_(alloc), slots_(alloc) {}
+
+    template <typename Map, typename Entry>
+    class basic_iterator
+    {
+    public:
+        basic_iterator(Map* map, std::size_t slot) : map_(map), slot_(slot) { skip_unused(); }
+
+        Entry& operator*() const { return (*map_).slots_[slot_]; }
+        Entry* operator->() const { return &(*map_).slots_[slot_]; }
+        basic_iterator& operator++() { ++slot_; skip_unused(); return *this; }
+        bool operator==(basic_iterator const& other) const { return slot_ == other.slot_; }
+        bool operator!=(basic_iterator const& other) const { return slot_ != other.slot_; }
+
+    private:
+        friend class FlatHashMap;
+        Map* map_;
+        std::size_t slot_;
+
+        void skip_unused()
+        {
+            while (slot_ < (*map_).ctrl_.size() && (*map_).ctrl_[slot_] & EMPTY) {
+                ++slot_;
+            }
+        }
+    };
+    using iterator = basic_iterator<FlatHashMap, value_type>;
+    using const_iterator = basic_iterator<FlatHashMap const, value_type const>;
+
+    iterator begin() { return {this, 0}; }
+    iterator end() { return {this, ctrl_.size()}; }
+    const_iterator begin() const { return {this, 0}; }
+    const_iterator end() const { return {this, ctrl_.size()}; }
+
+    std::size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    // Also gives the arrays back to the allocator
+    void clear()
+    {
+        ctrl_ = Ctrl(ctrl_.get_allocator());
+        slots_ = Slots(slots_.get_allocator());
+        size_ = 0;
+        growth_left_ = 0;
+    }
+
+    // Makes room for n entries without rehashing
+    void reserve(std::size_t n)
+    {
+        if (n > capacity_for(ctrl_.size())) {
+            rehash(slots_for(n));
+        }
+    }
+
+    // Lookups take a Key, or anything else that Hash and Equal accept
+    template <typename K = Key>
+    iterator find(K const& key) { return {this, find_slot(key)}; }
+    template <typename K = Key>
+    const_iterator find(K const& key) const { return {this, find_slot(key)}; }
+
+    template <typename K = Key>
+    bool contains(K const& key) const { return find_slot(key) != ctrl_.size(); }
+
+    template <typename K = Key>
+    Value& at(K const& key)
+    {
+        auto slot = find_slot(key);
+        if (slot == ctrl_.size()) {
+            throw std::out_of_range("FlatHashMap::at");
+        }
+        return slots_[slot].second;
+    }
+    template <typename K = Key>
+    Value const& at(K const& key) const
+    {
+        auto slot = find_slot(key);
+        if (slot == ctrl_.size()) {
+            throw std::out_of_range("FlatHashMap::at");
+        }
+        return slots_[slot].second;
+    }
+
+    Value& operator[](Key const& key) { return (*try_emplace(key).first).second; }
+
+    std::pair<iterator, bool> insert(value_type entry)
+    {
+        auto result = try_emplace(entry.first);
+        if (result.second) {
+            (*result.first).second = std::move(entry.second);
+        }
+        return result;
+    }
+
+    // Adds key with a default constructed value if it is missing
+    std::pair<iterator, bool> try_emplace(Key const& key)
+    {
+        auto hash = mix(Hash()(key));
+        auto slot = find_slot(key, hash);
+        if (slot != ctrl_.size()) {
+            return {{this, slot}, false};
+        }
+
+        if (ctrl_.empty()) {
+            rehash(GROUP);
+        }
+        slot = free_slot(hash);
+        if (growth_left_ == 0 && ctrl_[slot] == EMPTY) {
+            rehash(slots_for(size_ + 1));
+            slot = free_slot(hash);
+        }
+        if (ctrl_[slot] == EMPTY) {
+            --growth_left_;
+        }
+        ctrl_[slot] = h2(hash);
+        slots_[slot].first = key;
+        ++size_;
+        return {{this, slot}, true};
+    }
+
+    template <typename K = Key>
+    std::size_t erase(K const& key)
+    {
+        auto slot = find_slot(key);
+        if (slot == ctrl_.size()) {
+            return 0;
+        }
+        erase(iterator(this, slot));
+        return 1;
+    }
+
+    void erase(iterator position)
+    {
+        auto slot = position.slot_;
+        slots_[slot] = value_type();
+        --size_;
+        // A probe only walks past a group that has no empty slots, so a
+        // slot in a group that still has one can be made empty again
+        if (match_empty(load_group(slot & ~(GROUP - 1)))) {
+            ctrl_[slot] = EMPTY;
+            ++growth_left_;
+        } else {
+            ctrl_[slot] = ERASED;
+        }
+    }
+
+private:
+    static constexpr std::size_t GROUP = 8;
+    static constexpr unsigned char EMPTY = 0x80;
+    static constexpr unsigned char ERASED = 0xFE;
+    static constexpr std::uint64_t LSBS = 0x0101010101010101ULL;
+    static constexpr std::uint64_t MSBS = 0x8080808080808080ULL;
+
+    using Ctrl = std::vector<unsigned char, typename std::allocator_traits<Allocator>::template rebind_alloc<unsigned char>>;
+    using Slots = std::vector<value_type, Allocator>;
+
+    Ctrl ctrl_;
+    Slots slots_;
+    std::size_t size_ = 0;
+    std::size_t growth_left_ = 0;  // empty slots that can still be used before a rehash
+
+    // Spreads the bits of hashes like std::hash<integer> that return the
+    // value itself, so that keys differing only in their high bits (ids
+    // that are multiples of a power of two) still land in different
+    // groups: the low bits pick the group, the top 7 go to ctrl_. This is
+    // the MurmurHash3 finalizer, every input bit affects every output bit.
+    static std::uint64_t mix(std::size_t hash)
+    {
+        auto h = static_cast<std::uint64_t>(hash);
+        h ^= h >> 33;
+        h *= 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 33;
+        h *= 0xC4CEB9FE1A85EC53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+    static unsigned char h2(std::uint64_t hash) { return static_cast<unsigned char>(hash >> 57); }
+
+    // Full groups are used up to 7/8
+    static std::size_t capacity_for(std::size_t slots) { return slots - slots / 8; }
+    static std::size_t slots_for(std::size_t n)
+    {
+        std::size_t slots = GROUP;
+        while (capacity_for(slots) < n) {
+            slots *= 2;
+        }
+        return slots;
+    }
+
+    // The control bytes of a group, first slot in the lowest byte
+    std::uint64_t load_group(std::size_t first) const
+    {
+        std::uint64_t group;
+        std::memcpy(&group, ctrl_.data() + first, GROUP);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        group = __builtin_bswap64(group);
+#endif
+        return group;
+    }
+
+    // Bit 8*i+7 set for the bytes that may equal h (a borrow can flag a
+    // byte above a real match too, so every hit still compares keys)
+    static std::uint64_t match(std::uint64_t group, unsigned char h)
+    {
+        auto x = group ^ (LSBS * h);
+        return (x - LSBS) & ~x & MSBS;
+    }
+    // EMPTY is the only control byte with the top bit set and bit 1 clear
+    static std::uint64_t match_empty(std::uint64_t group) { return group & ~(group << 6) & MSBS; }
+    static std::uint64_t match_free(std::uint64_t group) { return group & MSBS; }
+    static std::size_t first_byte(std::uint64_t mask) { return __builtin_ctzll(mask) / 8; }
+
+    // Groups in triangular order, which visits every group once when the
+    // group count is a power of two
+    template <typename Visit>
+    std::size_t probe(std::uint64_t hash, Visit visit) const
+    {
+        auto groups = ctrl_.size() / GROUP;
+        auto group = static_cast<std::size_t>(hash) & (groups - 1);
+        for (std::size_t step = 1; step <= groups; ++step) {
+            auto slot = visit(group * GROUP);
+            if (slot != GROUP) {
+                return group * GROUP + slot;
+            }
+            group = (group + step) & (groups - 1);
+        }
+        return ctrl_.size();
+    }
+
+    template <typename K>
+    std::size_t find_slot(K const& key) const
+    {
+        return ctrl_.empty() ? 0 : find_slot(key, mix(Hash()(key)));
+    }
+
+    template <typename K>
+    std::size_t find_slot(K const& key, std::uint64_t hash) const
+    {
+        if (ctrl_.empty()) {
+            return 0;
+        }
+        std::size_t missing = ctrl_.size();
+        auto found = probe(hash, [&](std::size_t first) {
+            auto group = load_group(first);
+            for (auto hits = match(group, h2(hash)); hits != 0; hits &= hits - 1) {
+                auto i = first_byte(hits);
+                if (Equal()(slots_[first + i].first, key)) {
+                    return i;
+                }
+            }
+            // An empty slot ends the probe sequence
+            return match_empty(group) ? missing : GROUP;
+        });
+        return found >= ctrl_.size() ? missing : found;
+    }
+
+    // First empty or erased slot on the probe sequence of hash
+    std::size_t free_slot(std::uint64_t hash) const
+    {
+        if (ctrl_.empty()) {
+            return 0;
+        }
+        return probe(hash, [this](std::size_t first) {
+            auto free = match_free(load_group(first));
+            return free ? first_byte(free) : GROUP;
+        });
+    }
+
+    void rehash(std::size_t slots)
+    {
+        Ctrl old_ctrl(slots, EMPTY, ctrl_.get_allocator());
+        Slots old_slots(slots, slots_.get_allocator());
+        // Swapped so that the old_ vectors hold the old entries
+        old_ctrl.swap(ctrl_);
+        old_slots.swap(slots_);
+        growth_left_ = capacity_for(slots) - size_;
+
+        for (std::size_t i = 0; i < old_ctrl.size(); ++i) {
+            if (!(old_ctrl[i] & EMPTY)) {
+                auto hash = mix(Hash()(old_slots[i].first));
+                auto slot = free_slot(hash);
+                ctrl_[slot] = h2(hash);
+                slots_[slot] = std::move(old_slots[i]);
+            }
+        }
+    }
+};
+
+#endif // FLAT_HASH_MAP_HH
@@ -17,10 +17,25 @@
 # "Rebuild all" from the Build menu
 #  QMAKE_CXXFLAGS += -DUSE_PERF_EVENT
 
+# Uncomment the line below to index station coordinates with a uniform grid instead of a k-d tree
+# (find_station_with_coord becomes O(1), nearest station queries search rings of grid cells)
+# NOTE: If you uncomment or recomment the line, remember to recompile EVERYTHING
+#QMAKE_CXXFLAGS += -DUSE_GRID_INDEX
+
+# Uncomment the line below to let stations_closest_to_bruteforce use AVX2 (SSE4.1 is -msse4.1).
+# NOTE: The program then only runs on processors that support AVX2
+#QMAKE_CXXFLAGS += -mavx2
+
 QT       += core gui
 
 CONFIG += c++17 warn_on
 
+# Datastructures allocates from std::pmr memory resources (<memory_resource>).
+# Apple's libc++ only provides them from macOS 14 on, so macOS builds need
+# Xcode 15 or newer and this deployment target. Other platforms ignore it.
+# NOTE: Run qmake again after changing this, the Makefile has the old target
+QMAKE_MACOSX_DEPLOYMENT_TARGET = 14.0
+
 greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 
 TARGET = prg1
@@ -45,6 +60,8 @@ SOURCES += \
 
 HEADERS += \
     datastructures.hh \
+    btree.hh \
+    flat_hash_map.hh \
     mainwindow.hh \
     mainprogram.hh
 